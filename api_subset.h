@@ -0,0 +1,122 @@
+#ifndef API_SUBSET_H
+#define API_SUBSET_H
+
+#include <cstdint>
+#include <type_traits>
+
+#include "vulkan/vulkan.h"
+
+/* Compile-time API surface, for minimal loader builds.
+ *
+ * By default there's no subset: Any extension an ICD has is passed along, and any
+ * command an ICD knows can be had from vkGetInstanceProcAddr, via the tramp_pool
+ * if need be. Building with -DVKTL_API_SUBSET='"my_subset.h"' includes a header
+ * that defines either or both of:
+ *
+ *  VKTL_MAX_API_VERSION: E.g. VK_API_VERSION_1_0. Caps the instance version we
+ *     report, and the apiVersion we pass on to ICDs.
+ *
+ *  VKTL_ALLOWED(EXT, FN): The only instance and device extensions to advertise
+ *     or enable, and the only commands beyond the loader's own that
+ *     vkGetInstanceProcAddr hands out. There's no registry in-tree, so list each
+ *     extension's commands along with it, plus any core commands the app gets
+ *     from vkGetInstanceProcAddr instead of vkGetDeviceProcAddr:
+ *
+ *        #define VKTL_ALLOWED(EXT, FN) \
+ *           EXT(VK_KHR_surface) \
+ *           FN(vkDestroySurfaceKHR) \
+ *           FN(vkGetPhysicalDeviceSurfaceSupportKHR)
+ *
+ *     That goes for the loader's own commands too, past the few it can't do
+ *     without (BOOTSTRAP_FNS below), so list e.g. vkGetPhysicalDeviceProperties
+ *     if the app wants it. vkGetInstanceProcAddr is then our only export, and
+ *     unlisted commands' names and code are left out of the binary, given
+ *     -ffunction-sections -Wl,--gc-sections (or LTO).
+ *
+ *     The trampoline pools (and every ICD instance's and device's slot arrays)
+ *     are then sized to fit, instead of 256 + 1024.
+ */
+#ifdef VKTL_API_SUBSET
+#include VKTL_API_SUBSET
+#endif
+
+#ifdef VKTL_MAX_API_VERSION
+constexpr uint32_t MAX_API_VERSION = VKTL_MAX_API_VERSION;
+#else
+constexpr uint32_t MAX_API_VERSION = UINT32_MAX;
+#endif
+
+#ifdef VKTL_ALLOWED
+
+#define VKTL_SUBSET_NAME_(x) #x,
+#define VKTL_SUBSET_SKIP_(x)
+#define VKTL_SUBSET_ONE_(x) + 1
+
+// An integer-literal expression, for the trampolines' `.rept`.
+#define VKTL_ALLOWED_FN_COUNT (0 VKTL_ALLOWED(VKTL_SUBSET_SKIP_, VKTL_SUBSET_ONE_))
+
+constexpr bool HAS_API_SUBSET = true;
+
+// Null-terminated.
+constexpr const char* ALLOWED_EXTS[] = {
+   VKTL_ALLOWED(VKTL_SUBSET_NAME_, VKTL_SUBSET_SKIP_) nullptr
+};
+constexpr const char* ALLOWED_FNS[] = {
+   VKTL_ALLOWED(VKTL_SUBSET_SKIP_, VKTL_SUBSET_NAME_) nullptr
+};
+// Allowed even if unlisted, since there's no instance or device without them.
+constexpr const char* BOOTSTRAP_FNS[] = {
+   "vkGetInstanceProcAddr",
+   "vkCreateInstance",
+   "vkDestroyInstance",
+   "vkEnumeratePhysicalDevices",
+   "vkCreateDevice",
+   "vkGetDeviceProcAddr",
+   "vkDestroyDevice",
+   nullptr
+};
+
+// constexpr, unlike strcmp, so that name tables can be trimmed at compile time.
+constexpr bool
+api_subset_str_eq(const char* a, const char* b)
+{
+   for (; *a == *b; a++, b++) {
+      if (!*a)
+         return true;
+   }
+   return false;
+}
+
+constexpr bool
+api_subset_has(const char* const* list, const char* const name)
+{
+   for (; *list; list++) {
+      if (api_subset_str_eq(*list, name))
+         return true;
+   }
+   return false;
+}
+
+constexpr bool api_subset_allows_ext(const char* const name) {
+   return api_subset_has(ALLOWED_EXTS, name);
+}
+constexpr bool api_subset_allows_fn(const char* const name) {
+   return api_subset_has(ALLOWED_FNS, name) || api_subset_has(BOOTSTRAP_FNS, name);
+}
+
+#else
+
+constexpr bool HAS_API_SUBSET = false;
+
+constexpr bool api_subset_allows_ext(const char*) { return true; }
+constexpr bool api_subset_allows_fn(const char*) { return true; }
+
+#endif // VKTL_ALLOWED
+
+// For name tables, where a literal `name` (e.g. "vkDestroySurfaceKHR") the subset
+// leaves out should be left out of the binary too: Always a compile-time constant.
+#define VKTL_SUBSET_ALLOWS_FN(name) \
+   (std::integral_constant<bool, api_subset_allows_fn(name)>::value)
+#define VKTL_SUBSET_FN_NAME(name) (VKTL_SUBSET_ALLOWS_FN(name) ? name : nullptr)
+
+#endif // API_SUBSET_H
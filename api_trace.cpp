@@ -0,0 +1,411 @@
+#include "api_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include "Windows.h"
+#include <process.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#include "utils.h"
+
+// On Linux, the coarse clock: The same base as steady_clock, at a few ms of
+// resolution, which is plenty for spotting hangs. It's a fraction of the cost,
+// which otherwise dominates that of tracing.
+uint64_t
+trace_now_ns()
+{
+#ifdef __linux__
+   timespec ts;
+   (void)clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+   return uint64_t(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+#else
+   const auto now = std::chrono::steady_clock::now().time_since_epoch();
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+#endif
+}
+
+static uint64_t
+current_pid()
+{
+#ifdef _WIN32
+   return _getpid();
+#else
+   return getpid();
+#endif
+}
+
+static uint64_t
+current_thread_id()
+{
+#if defined(_WIN32)
+   return GetCurrentThreadId();
+#elif defined(__linux__)
+   return syscall(SYS_gettid);
+#elif defined(__APPLE__)
+   uint64_t ret = 0;
+   (void)pthread_threadid_np(nullptr, &ret);
+   return ret;
+#else
+   return (uint64_t)pthread_self();
+#endif
+}
+
+static std::string
+shm_name(const uint64_t pid)
+{
+   const auto name = "vk_tiny_loader.trace." + std::to_string(pid);
+#ifdef _WIN32
+   return "Local\\" + name;
+#else
+   return "/" + name;
+#endif
+}
+
+static size_t
+names_size(const uint32_t fn_count)
+{
+   return (size_t(fn_count) * TRACE_NAME_SIZE + 63) / 64 * 64;
+}
+
+static size_t
+ring_bytes(const uint32_t ring_size)
+{
+   return sizeof(TraceRing) + size_t(ring_size) * sizeof(TraceRecord);
+}
+
+// -
+
+/*static*/ size_t
+TraceMap::Size(const uint32_t fn_count, const uint32_t ring_count,
+               const uint32_t ring_size)
+{
+   return sizeof(TraceHeader) + names_size(fn_count) + ring_count * ring_bytes(ring_size);
+}
+
+/*static*/ std::unique_ptr<TraceMap>
+TraceMap::Create(const uint32_t ring_count, const uint32_t ring_size,
+                 std::string* const out_err)
+{
+   const auto pid = current_pid();
+   const auto name = shm_name(pid);
+   const auto size = Size(TRACE_FN_COUNT, ring_count, ring_size);
+
+   auto ret = std::unique_ptr<TraceMap>(new TraceMap);
+   ret->size_ = size;
+#ifdef _WIN32
+   ret->mapping_ = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                      DWORD(uint64_t(size) >> 32), DWORD(size),
+                                      to_wstring(name).c_str());
+   if (!ret->mapping_) {
+      *out_err = "CreateFileMappingW failed: " + std::to_string(GetLastError());
+      return {};
+   }
+   ret->base_ = (uint8_t*)MapViewOfFile(ret->mapping_, FILE_MAP_WRITE, 0, 0, size);
+   if (!ret->base_) {
+      *out_err = "MapViewOfFile failed: " + std::to_string(GetLastError());
+      return {};
+   }
+#else
+   const auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+   if (fd == -1) {
+      *out_err = std::string("shm_open failed: ") + strerror(errno);
+      return {};
+   }
+   const auto ok = (ftruncate(fd, size) == 0);
+   const auto err = errno;
+   void* p = MAP_FAILED;
+   if (ok) {
+      p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+   (void)close(fd);
+   if (p == MAP_FAILED) {
+      *out_err = std::string(ok ? "mmap" : "ftruncate") + " failed: " +
+                 strerror(ok ? errno : err);
+      (void)shm_unlink(name.c_str());
+      return {};
+   }
+   ret->base_ = (uint8_t*)p;
+#endif
+
+   auto& header = ret->header();
+   header.pid = pid;
+   header.fn_count = TRACE_FN_COUNT;
+   header.ring_count = ring_count;
+   header.ring_size = ring_size;
+   std::atomic_thread_fence(std::memory_order_release);
+   memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+   return ret;
+}
+
+/*static*/ std::unique_ptr<TraceMap>
+TraceMap::Open(const uint64_t pid, std::string* const out_err)
+{
+   const auto name = shm_name(pid);
+
+   auto ret = std::unique_ptr<TraceMap>(new TraceMap);
+#ifdef _WIN32
+   ret->mapping_ = OpenFileMappingW(FILE_MAP_READ, FALSE, to_wstring(name).c_str());
+   if (!ret->mapping_) {
+      *out_err = "OpenFileMappingW failed: " + std::to_string(GetLastError());
+      return {};
+   }
+   ret->base_ = (uint8_t*)MapViewOfFile(ret->mapping_, FILE_MAP_READ, 0, 0, 0);
+   if (!ret->base_) {
+      *out_err = "MapViewOfFile failed: " + std::to_string(GetLastError());
+      return {};
+   }
+   MEMORY_BASIC_INFORMATION info = {};
+   (void)VirtualQuery(ret->base_, &info, sizeof(info));
+   ret->size_ = info.RegionSize;
+#else
+   const auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+   if (fd == -1) {
+      *out_err = std::string("shm_open failed: ") + strerror(errno);
+      return {};
+   }
+   struct stat st = {};
+   void* p = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && st.st_size) {
+      p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   }
+   (void)close(fd);
+   if (p == MAP_FAILED) {
+      *out_err = std::string("mmap failed: ") + strerror(errno);
+      return {};
+   }
+   ret->base_ = (uint8_t*)p;
+   ret->size_ = st.st_size;
+#endif
+
+   if (ret->size_ < sizeof(TraceHeader)) {
+      *out_err = "Truncated.";
+      return {};
+   }
+   const auto& header = ret->header();
+   if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+      *out_err = "Bad magic.";
+      return {};
+   }
+   std::atomic_thread_fence(std::memory_order_acquire);
+   const auto pot = header.ring_size && !(header.ring_size & (header.ring_size - 1));
+   if (!pot || Size(header.fn_count, header.ring_count, header.ring_size) > ret->size_) {
+      *out_err = "Bad layout.";
+      return {};
+   }
+   return ret;
+}
+
+/*static*/ bool
+TraceMap::Remove(const uint64_t pid)
+{
+#ifdef _WIN32
+   (void)pid;
+   return false; // Goes when the last handle does.
+#else
+   return shm_unlink(shm_name(pid).c_str()) == 0;
+#endif
+}
+
+TraceMap::~TraceMap()
+{
+#ifdef _WIN32
+   if (base_) {
+      (void)UnmapViewOfFile(base_);
+   }
+   if (mapping_) {
+      (void)CloseHandle(mapping_);
+   }
+#else
+   if (base_) {
+      (void)munmap(base_, size_);
+   }
+#endif
+}
+
+void
+TraceMap::detach()
+{
+#ifndef _WIN32
+   // Only the header matters. The child's threads claim rings afresh.
+   uint8_t header_copy[sizeof(TraceHeader)];
+   memcpy(header_copy, base_, sizeof(header_copy));
+   (void)mmap(base_, size_, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+   memcpy(base_, header_copy, sizeof(header_copy));
+#endif
+}
+
+char*
+TraceMap::name(const uint32_t fn) const
+{
+   return (char*)base_ + sizeof(TraceHeader) + size_t(fn) * TRACE_NAME_SIZE;
+}
+
+TraceRing&
+TraceMap::ring(const uint32_t i) const
+{
+   const auto& h = header();
+   const auto offset = sizeof(TraceHeader) + names_size(h.fn_count) +
+                       i * ring_bytes(h.ring_size);
+   return *(TraceRing*)(base_ + offset);
+}
+
+// -
+
+/*static*/ TraceMap* ApiTrace::s_map = nullptr;
+
+static thread_local TraceRing* t_ring = nullptr;
+static thread_local bool t_claimed = false; // Even if every ring was taken.
+
+// Frees this thread's ring as it exits. Its records stay readable until another
+// thread needs the ring.
+struct RingRelease final
+{
+   TraceRing* ring = nullptr;
+
+   ~RingRelease() {
+      if (ring) {
+         ring->in_use.store(0, std::memory_order_release);
+      }
+   }
+};
+static thread_local RingRelease t_release;
+
+static TraceRing*
+claim_ring()
+{
+   t_claimed = true;
+   const auto& map = *ApiTrace::s_map;
+   auto& header = map.header();
+   // Never-claimed rings first, so that exited threads' calls last longer.
+   for (const bool fresh_only : {true, false}) {
+      for (uint32_t i = 0; i < header.ring_count; i++) {
+         auto& ring = map.ring(i);
+         if (fresh_only && ring.thread_id.load(std::memory_order_relaxed))
+            continue;
+         uint32_t expected = 0;
+         if (!ring.in_use.compare_exchange_strong(expected, 1, std::memory_order_acq_rel))
+            continue;
+         ring.thread_id.store(current_thread_id(), std::memory_order_relaxed);
+         ring.first.store(ring.head.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_release);
+         t_ring = &ring;
+         t_release.ring = &ring;
+         return &ring;
+      }
+   }
+   header.untraced_threads.fetch_add(1, std::memory_order_relaxed);
+   return nullptr;
+}
+
+static uint32_t
+env_u32(const char* const name, const uint32_t fallback)
+{
+   const auto env = getenv(name);
+   if (!env || !*env)
+      return fallback;
+   return uint32_t(std::min<unsigned long>(strtoul(env, nullptr, 10), 1 << 20));
+}
+
+/*static*/ void
+ApiTrace::Start()
+{
+   const auto env = getenv("VK_TINY_LOADER_TRACE");
+   if (!env || !*env || std::string(env) == "0")
+      return;
+
+   const auto min_ring_size = env_u32("VK_TINY_LOADER_TRACE_RECORDS", 1024);
+   uint32_t ring_size = 1;
+   while (ring_size < min_ring_size) {
+      ring_size *= 2;
+   }
+   const auto ring_count = env_u32("VK_TINY_LOADER_TRACE_THREADS", 64);
+   std::string err;
+   auto map = TraceMap::Create(ring_count, ring_size, &err);
+   if (!map) {
+      debug_log("Not tracing: %s", err.c_str());
+      return;
+   }
+#define _(x) snprintf(map->name(TRACE_##x), TRACE_NAME_SIZE, "vk" #x);
+   FOR_EACH_EXPORTED_FN(_)
+   FOR_EACH_WRAPPED_DEVICE_FN(_)
+#undef _
+   s_map = map.release(); // Never unmapped, for threads still calling in at exit.
+   debug_log("Tracing %u calls each for up to %u threads.", ring_size, ring_count);
+
+#ifndef _WIN32
+   (void)pthread_atfork(nullptr, nullptr, []() {
+      s_map->detach();
+      t_ring = nullptr;
+      t_claimed = false;
+      t_release.ring = nullptr;
+   });
+#endif
+}
+
+/*static*/ void
+ApiTrace::Finish()
+{
+   if (!s_map)
+      return;
+   const auto pid = s_map->header().pid;
+   if (pid == current_pid()) { // Not a forked child.
+      (void)TraceMap::Remove(pid);
+   }
+}
+
+/*static*/ TraceRecord*
+ApiTrace::Begin(const uint16_t fn, const void* const handle, const TraceState state,
+                uint64_t* const out_seq)
+{
+   auto ring = t_ring;
+   if (!ring) {
+      if (t_claimed)
+         return nullptr;
+      ring = claim_ring();
+      if (!ring)
+         return nullptr;
+   }
+   const auto& map = *s_map;
+   const auto mask = map.header().ring_size - 1;
+   const auto seq = ring->head.load(std::memory_order_relaxed) + 1;
+   auto& rec = map.records(*ring)[(seq - 1) & mask];
+
+   rec.seq.store(0, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+   rec.time_ns = trace_now_ns();
+   rec.handle = (uintptr_t)handle;
+   rec.fn = fn;
+   rec.state.store(state, std::memory_order_relaxed);
+   rec.result = 0;
+   rec.seq.store(seq, std::memory_order_release);
+   ring->head.store(seq, std::memory_order_release);
+   *out_seq = seq;
+   return &rec;
+}
+
+/*static*/ void
+ApiTrace::SetName(const uint32_t fn, const char* const name)
+{
+   if (!s_map || fn >= TRACE_FN_COUNT)
+      return;
+   snprintf(s_map->name(fn), TRACE_NAME_SIZE, "%s", name);
+}
@@ -0,0 +1,267 @@
+#ifndef API_TRACE_H
+#define API_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "tramp_pool.h"
+#include "vulkan/vulkan.h"
+
+/* Opt-in call tracing, for post-mortems of hung or crashed processes.
+ *
+ * VK_TINY_LOADER_TRACE=1: Each thread that calls in gets a ring of fixed-size
+ *    records in a shared-memory file (shm_open's "/vk_tiny_loader.trace.<pid>",
+ *    i.e. /dev/shm/ on Linux). Calls into our entrypoints write a record as they
+ *    start and fill in their result as they return, so a hung call shows up as
+ *    still running. `dump_trace <pid>` reads them out, from outside the process.
+ * VK_TINY_LOADER_TRACE_RECORDS: Per thread, rounded up to a power of two.
+ *    (default 1024)
+ * VK_TINY_LOADER_TRACE_THREADS: Threads traced at once. (default 64) Rings of
+ *    threads that have exited are reused last.
+ *
+ * While tracing, instances are never passthrough, and vkGetDeviceProcAddr hands out
+ * traced tramp_pool trampolines instead of the ICD's own functions, so that device
+ * commands come through us too. Trampolines tail-call the driver, so their
+ * records don't get a result.
+ *
+ * The file is removed on normal exit, but left behind on crashes, until
+ * `dump_trace --remove`. (On Windows it's a named mapping, which only lasts as
+ * long as the process.) Forked children trace into private memory instead.
+ */
+
+#define FOR_EACH_EXPORTED_FN(X) \
+   X(CreateInstance) \
+   X(EnumerateInstanceExtensionProperties) \
+   X(EnumerateInstanceLayerProperties) \
+   X(EnumerateInstanceVersion) \
+   X(GetInstanceProcAddr) \
+   X(DestroyInstance) \
+   X(EnumeratePhysicalDevices) \
+   X(GetPhysicalDeviceFeatures) \
+   X(GetPhysicalDeviceFormatProperties) \
+   X(GetPhysicalDeviceImageFormatProperties) \
+   X(GetPhysicalDeviceProperties) \
+   X(GetPhysicalDeviceQueueFamilyProperties) \
+   X(GetPhysicalDeviceMemoryProperties) \
+   X(CreateDevice) \
+   X(EnumerateDeviceExtensionProperties) \
+   X(EnumerateDeviceLayerProperties) \
+   X(GetDeviceProcAddr) \
+   X(DestroyDevice)
+
+// Device commands that hand out queues and command buffers, which we always wrap,
+// so that device trampolines can find their way from those too.
+#define FOR_EACH_WRAPPED_DEVICE_FN(X) \
+   X(GetDeviceQueue) \
+   X(GetDeviceQueue2) \
+   X(AllocateCommandBuffers)
+
+enum TraceFn : uint16_t {
+#define _(x) TRACE_##x,
+   FOR_EACH_EXPORTED_FN(_)
+   FOR_EACH_WRAPPED_DEVICE_FN(_)
+#undef _
+   TRACE_OWN_FN_COUNT
+};
+
+// Then a TraceFn per trampoline.
+constexpr uint32_t TRACE_PHYS_DEV_TRAMP_BASE = TRACE_OWN_FN_COUNT;
+constexpr uint32_t TRACE_DEVICE_TRAMP_BASE = TRACE_PHYS_DEV_TRAMP_BASE +
+                                             PHYS_DEV_TRAMP_COUNT;
+constexpr uint32_t TRACE_FN_COUNT = TRACE_DEVICE_TRAMP_BASE + DEVICE_TRAMP_COUNT;
+static_assert(TRACE_FN_COUNT <= UINT16_MAX, "");
+
+// -
+// Shared-memory layout: (native endian, since it never leaves the machine)
+//    TraceHeader
+//    char names[fn_count][TRACE_NAME_SIZE] (padded to 64 bytes)
+//    (TraceRing, TraceRecord[ring_size]) * ring_count
+//
+// Each ring has a single writer, its thread. Readers check a record's seq before
+// and after reading it, and skip it if it changed.
+
+constexpr char TRACE_MAGIC[8] = {'V','K','T','L','T','R','C','1'};
+constexpr uint32_t TRACE_NAME_SIZE = 96;
+
+struct TraceHeader final
+{
+   char magic[8];
+   uint64_t pid;
+   uint32_t fn_count;
+   uint32_t ring_count;
+   uint32_t ring_size; // Records per ring. A power of two.
+   std::atomic<uint32_t> untraced_threads; // Found every ring taken.
+   uint8_t pad[32];
+};
+static_assert(sizeof(TraceHeader) == 64, "");
+
+struct TraceRing final
+{
+   std::atomic<uint64_t> thread_id; // Of the latest owner. 0: Never claimed.
+   std::atomic<uint64_t> first; // Owner's first seq.
+   std::atomic<uint64_t> head; // Last seq written.
+   std::atomic<uint32_t> in_use; // 0 once its owner exits.
+   uint8_t pad[36];
+};
+static_assert(sizeof(TraceRing) == 64, "");
+
+enum TraceState : uint16_t {
+   TRACE_CALLED, // Hasn't returned. (yet)
+   TRACE_RETURNED,
+   TRACE_RETURNED_RESULT, // With a VkResult.
+   TRACE_JUMPED, // Trampolines tail-call the driver, so we never see them return.
+};
+
+struct TraceRecord final
+{
+   std::atomic<uint64_t> seq; // 1-based, per ring. 0 while being written.
+   uint64_t time_ns; // trace_now_ns(), which is system-wide.
+   uint64_t handle; // First arg, if any.
+   uint16_t fn; // TraceFn.
+   std::atomic<uint16_t> state; // TraceState.
+   int32_t result;
+};
+static_assert(sizeof(TraceRecord) == 32, "");
+
+uint64_t trace_now_ns();
+
+class TraceMap final
+{
+   uint8_t* base_ = nullptr;
+   size_t size_ = 0;
+#ifdef _WIN32
+   void* mapping_ = nullptr;
+#endif
+
+   TraceMap() = default;
+
+public:
+   static size_t Size(uint32_t fn_count, uint32_t ring_count, uint32_t ring_size);
+
+   // Read-write, for the loader. Replaces any stale file from an earlier pid.
+   static std::unique_ptr<TraceMap> Create(uint32_t ring_count, uint32_t ring_size,
+                                           std::string* out_err);
+   // Read-only, for readers. Checks the layout.
+   static std::unique_ptr<TraceMap> Open(uint64_t pid, std::string* out_err);
+   static bool Remove(uint64_t pid);
+   ~TraceMap();
+
+   // Forked children: Swap in private memory, so that the parent's file only
+   // has the parent's calls.
+   void detach();
+
+   TraceHeader& header() const { return *(TraceHeader*)base_; }
+   char* name(uint32_t fn) const;
+   TraceRing& ring(uint32_t i) const;
+   TraceRecord* records(const TraceRing& ring) const {
+      return (TraceRecord*)(&ring + 1);
+   }
+};
+
+// -
+// Recording, for the loader.
+
+class ApiTrace final
+{
+public:
+   static TraceMap* s_map; // Null unless tracing.
+
+   static bool enabled() { return s_map != nullptr; }
+
+   // From the env vars, at load time.
+   static void Start();
+   // At normal exit. Leaves the mapping in place for threads still calling in.
+   static void Finish();
+
+   // Null if this thread has no ring.
+   static TraceRecord* Begin(uint16_t fn, const void* handle, TraceState state,
+                             uint64_t* out_seq);
+   static void End(TraceRecord* rec, uint64_t seq, TraceState state, int32_t result) {
+      if (rec->seq.load(std::memory_order_relaxed) != seq)
+         return; // Lapped by nested calls.
+      rec->result = result;
+      rec->state.store(state, std::memory_order_release);
+   }
+
+   static void SetName(uint32_t fn, const char* name);
+};
+
+// Traces one call to one of our own functions, from construction to destruction.
+class TraceCall final
+{
+   TraceRecord* rec_ = nullptr;
+   uint64_t seq_ = 0;
+
+public:
+   TraceCall(const TraceFn fn, const void* const handle) {
+      if (ApiTrace::enabled()) {
+         rec_ = ApiTrace::Begin(fn, handle, TRACE_CALLED, &seq_);
+      }
+   }
+   ~TraceCall() {
+      if (rec_) {
+         ApiTrace::End(rec_, seq_, TRACE_RETURNED, 0);
+      }
+   }
+   TraceCall(const TraceCall&) = delete;
+   TraceCall& operator=(const TraceCall&) = delete;
+
+   VkResult ret(const VkResult res) {
+      if (rec_) {
+         ApiTrace::End(rec_, seq_, TRACE_RETURNED_RESULT, res);
+         rec_ = nullptr;
+      }
+      return res;
+   }
+   template<typename T>
+   T ret(const T val) {
+      return val;
+   }
+};
+
+template<typename RetT>
+struct TracedBody final
+{
+   template<typename BodyT>
+   static RetT Run(TraceCall* const trace, const BodyT& body) {
+      return trace->ret(body());
+   }
+};
+
+template<>
+struct TracedBody<void> final
+{
+   template<typename BodyT>
+   static void Run(TraceCall*, const BodyT& body) {
+      body();
+   }
+};
+
+template<typename BodyT>
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+auto
+traced_slow(const TraceFn fn, const void* const handle, const BodyT body)
+   -> decltype(body())
+{
+   TraceCall trace(fn, handle);
+   return TracedBody<decltype(body())>::Run(&trace, body);
+}
+
+// Runs `body` as one traced call, if tracing. Otherwise, it's just the body and a
+// branch: No frame, and calls to the driver stay tail calls. (so capture by value,
+// and hand small bodies to traced_slow in registers)
+template<typename BodyT>
+inline auto
+traced(const TraceFn fn, const void* const handle, const BodyT& body)
+   -> decltype(body())
+{
+   if (ApiTrace::enabled())
+      return traced_slow(fn, handle, body);
+   return body();
+}
+
+#endif // API_TRACE_H
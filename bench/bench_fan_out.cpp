@@ -0,0 +1,65 @@
+#include "bench_utils.h"
+
+/* bench_fan_out
+ * Times vkCreateInstance plus the first vkEnumeratePhysicalDevices over mocks A
+ * and B, each spending MOCK_ICD_CALL_MS (default 50) in both, with the calls into
+ * the two run in parallel (the default) and in order
+ * (VK_TINY_LOADER_PARALLEL_ICDS=0). Then again with mock B failing
+ * vkCreateInstance, which should leave an instance with just mock A.
+ */
+
+static void
+run(const char* const parallel_setting)
+{
+   setenv("VK_TINY_LOADER_PARALLEL_ICDS", parallel_setting, 1);
+   VkInstanceCreateInfo info = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+   const auto fn_time = [&](VkResult* const out_res, uint32_t* const out_count) {
+      const auto start = now_secs();
+      VkInstance inst;
+      *out_res = vkCreateInstance(&info, nullptr, &inst);
+      *out_count = 0;
+      if (*out_res == VK_SUCCESS) {
+         (void)vkEnumeratePhysicalDevices(inst, out_count, nullptr);
+      }
+      const auto ret = now_secs() - start;
+      if (*out_res == VK_SUCCESS) {
+         vkDestroyInstance(inst, nullptr);
+      }
+      return ret * 1000;
+   };
+
+   // Keep both loaded, so that dlopen isn't part of what's timed.
+   VkInstance keep_loaded;
+   if (vkCreateInstance(&info, nullptr, &keep_loaded) != VK_SUCCESS) {
+      fprintf(stderr, "No mock ICDs? Set VK_ICD_FILENAMES.\n");
+      _exit(1);
+   }
+
+   const uint32_t RUNS = 5;
+   VkResult res;
+   uint32_t count;
+   double total_ms = 0;
+   for (uint32_t i = 0; i < RUNS; i++) {
+      total_ms += fn_time(&res, &count);
+   }
+   printf("   VK_TINY_LOADER_PARALLEL_ICDS=%s: %6.1f ms, %u devices\n",
+          parallel_setting, total_ms / RUNS, count);
+
+   setenv("MOCK_ICD_B_FAIL_CREATE", "1", 1);
+   const auto failing_ms = fn_time(&res, &count);
+   printf("      With mock B failing: %6.1f ms, result %d, %u devices\n", failing_ms,
+          int(res), count);
+   vkDestroyInstance(keep_loaded, nullptr);
+}
+
+int
+main(const int, const char* const argv[])
+{
+   use_mock_icds(argv[0]);
+   setenv("MOCK_ICD_CALL_MS", "50", 0);
+   printf("vkCreateInstance + vkEnumeratePhysicalDevices, each ICD spending %s ms"
+          " in both:\n", getenv("MOCK_ICD_CALL_MS"));
+   in_child_process([]() { run("1"); });
+   in_child_process([]() { run("0"); });
+   return 0;
+}
@@ -0,0 +1,72 @@
+#include "bench_utils.h"
+
+/* bench_formats
+ * Times vkGetPhysicalDeviceFormatProperties over every core VkFormat, and
+ * vkGetPhysicalDeviceProperties, with and without
+ * VK_TINY_LOADER_CACHE_PHYS_DEV_QUERIES=1.
+ * MOCK_ICD_QUERY_NS=<n> makes each query cost the driver n ns more. (see
+ * mock_icd.cpp)
+ */
+
+template<typename FnT>
+static double
+ns_per_call(const uint32_t calls_per_pass, const FnT& fn_pass)
+{
+   fn_pass(); // Warm, and fill the cache if enabled.
+   uint64_t passes = 0;
+   const auto start = now_secs();
+   double elapsed = 0;
+   while (elapsed < 0.5) {
+      fn_pass();
+      passes += 1;
+      elapsed = now_secs() - start;
+   }
+   return elapsed * 1e9 / (passes * calls_per_pass);
+}
+
+static void
+run(const char* const cache_setting)
+{
+   setenv("VK_TINY_LOADER_CACHE_PHYS_DEV_QUERIES", cache_setting, 1);
+   VkInstanceCreateInfo info = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+   VkInstance inst;
+   VkPhysicalDevice phys_dev;
+   uint32_t count = 1;
+   if (vkCreateInstance(&info, nullptr, &inst) != VK_SUCCESS ||
+       vkEnumeratePhysicalDevices(inst, &count, &phys_dev) < 0 || !count)
+   {
+      fprintf(stderr, "No mock ICDs? Set VK_ICD_FILENAMES.\n");
+      _exit(1);
+   }
+
+   const auto formats_ns = ns_per_call(VK_FORMAT_RANGE_SIZE, [&]() {
+      for (uint32_t i = 0; i < VK_FORMAT_RANGE_SIZE; i++) {
+         VkFormatProperties props;
+         vkGetPhysicalDeviceFormatProperties(phys_dev, VkFormat(i), &props);
+      }
+   });
+   // Many per pass, so that reading the clock doesn't swamp a cached call.
+   const uint32_t PROPS_CALLS_PER_PASS = 1000;
+   const auto props_ns = ns_per_call(PROPS_CALLS_PER_PASS, [&]() {
+      for (uint32_t i = 0; i < PROPS_CALLS_PER_PASS; i++) {
+         VkPhysicalDeviceProperties props;
+         vkGetPhysicalDeviceProperties(phys_dev, &props);
+      }
+   });
+   printf("   VK_TINY_LOADER_CACHE_PHYS_DEV_QUERIES=%s:\n", cache_setting);
+   printf("      vkGetPhysicalDeviceFormatProperties: %8.1f ns\n", formats_ns);
+   printf("      vkGetPhysicalDeviceProperties:       %8.1f ns\n", props_ns);
+   vkDestroyInstance(inst, nullptr);
+}
+
+int
+main(const int, const char* const argv[])
+{
+   use_mock_icds(argv[0]);
+   const auto query_ns = getenv("MOCK_ICD_QUERY_NS");
+   printf("Per query, over all %u core formats, with the driver spending %s ns:\n",
+          uint32_t(VK_FORMAT_RANGE_SIZE), query_ns ? query_ns : "0");
+   in_child_process([]() { run("0"); });
+   in_child_process([]() { run("1"); });
+   return 0;
+}
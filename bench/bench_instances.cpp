@@ -0,0 +1,112 @@
+#include "bench_utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/* bench_instances [<max threads>]
+ * Runs 1, 2, 4... up to 64 threads, each looping vkCreateInstance,
+ * vkEnumeratePhysicalDevices and vkDestroyInstance, and reports the throughput
+ * at each thread count.
+ * Then measures how long vkEnumerateInstanceVersion on one thread stalls while
+ * another keeps loading and unloading a slow driver. (MOCK_ICD_B_LOAD_MS and
+ * MOCK_ICD_B_UNLOAD_MS, see mock_icd.cpp) The worst case is mostly scheduling
+ * noise where there are fewer CPUs than threads, so the 99th percentile is
+ * reported too.
+ */
+
+static void
+create_enumerate_destroy()
+{
+   VkInstanceCreateInfo info = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+   VkInstance inst;
+   if (vkCreateInstance(&info, nullptr, &inst) != VK_SUCCESS) {
+      fprintf(stderr, "vkCreateInstance failed.\n");
+      exit(1);
+   }
+   VkPhysicalDevice phys_devs[8];
+   uint32_t count = 8;
+   (void)vkEnumeratePhysicalDevices(inst, &count, phys_devs);
+   vkDestroyInstance(inst, nullptr);
+}
+
+static double
+loops_per_sec(const uint32_t thread_count, const double secs)
+{
+   std::atomic<bool> should_stop{false};
+   std::atomic<uint64_t> total{0};
+   std::vector<std::thread> threads;
+   for (uint32_t i = 0; i < thread_count; i++) {
+      threads.emplace_back([&]() {
+         uint64_t loops = 0;
+         while (!should_stop) {
+            create_enumerate_destroy();
+            loops += 1;
+         }
+         total += loops;
+      });
+   }
+   sleep_secs(secs);
+   should_stop = true;
+   for (auto& thread : threads) {
+      thread.join();
+   }
+   return total / secs;
+}
+
+int
+main(const int argc, const char* const argv[])
+{
+   uint32_t max_threads = 64;
+   if (argc > 1) {
+      max_threads = std::max(atoi(argv[1]), 1);
+   }
+   use_mock_icds(argv[0]);
+
+   // So that the loops measure the loader rather than dlopen.
+   VkInstanceCreateInfo info = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+   VkInstance keep_loaded;
+   if (vkCreateInstance(&info, nullptr, &keep_loaded) != VK_SUCCESS) {
+      fprintf(stderr, "No mock ICDs? Set VK_ICD_FILENAMES.\n");
+      return 1;
+   }
+
+   printf("Create/enumerate/destroy loops:\n");
+   double single = 0;
+   for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+      const auto rate = loops_per_sec(threads, 1.0);
+      if (threads == 1) {
+         single = rate;
+      }
+      printf("   %2u threads: %9.0f/s (x%.1f)\n", threads, rate, rate / single);
+   }
+   vkDestroyInstance(keep_loaded, nullptr);
+
+   // -
+
+   setenv("MOCK_ICD_B_LOAD_MS", "20", 0);
+   setenv("MOCK_ICD_B_UNLOAD_MS", "20", 0);
+   std::atomic<bool> should_stop{false};
+   std::thread churn([&]() {
+      while (!should_stop) {
+         create_enumerate_destroy(); // Loads and unloads each time.
+      }
+   });
+   std::vector<double> stall_ms;
+   const auto until = now_secs() + 1.0;
+   while (now_secs() < until) {
+      const auto start = now_secs();
+      uint32_t version;
+      (void)vkEnumerateInstanceVersion(&version);
+      stall_ms.push_back((now_secs() - start) * 1000);
+   }
+   should_stop = true;
+   churn.join();
+   std::sort(stall_ms.begin(), stall_ms.end());
+   printf("vkEnumerateInstanceVersion while another thread loads and unloads"
+          " mock B:\n   %.3f ms at p99, %.2f ms at worst (load %s ms, unload %s ms)\n",
+          stall_ms[stall_ms.size() * 99 / 100], stall_ms.back(),
+          getenv("MOCK_ICD_B_LOAD_MS"), getenv("MOCK_ICD_B_UNLOAD_MS"));
+   return 0;
+}
@@ -0,0 +1,73 @@
+#include "bench_utils.h"
+
+/* bench_passthrough
+ * Times physical-device calls with just mock A, where instances are passthrough
+ * by default, and with VK_TINY_LOADER_PASSTHROUGH=0. Both through the loader's
+ * own entrypoints, and through what vkGetInstanceProcAddr hands out, which with
+ * passthrough is the driver's own function.
+ */
+
+template<typename FnT>
+static double
+ns_per_call(const FnT& fn)
+{
+   const uint32_t CALLS_PER_PASS = 1000;
+   uint64_t passes = 0;
+   const auto start = now_secs();
+   double elapsed = 0;
+   while (elapsed < 0.5) {
+      for (uint32_t i = 0; i < CALLS_PER_PASS; i++) {
+         fn();
+      }
+      passes += 1;
+      elapsed = now_secs() - start;
+   }
+   return elapsed * 1e9 / (passes * CALLS_PER_PASS);
+}
+
+static void
+run(const char* const passthrough_setting)
+{
+   setenv("VK_TINY_LOADER_PASSTHROUGH", passthrough_setting, 1);
+   VkInstanceCreateInfo info = {VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO};
+   VkInstance inst;
+   VkPhysicalDevice phys_dev;
+   uint32_t count = 1;
+   if (vkCreateInstance(&info, nullptr, &inst) != VK_SUCCESS ||
+       vkEnumeratePhysicalDevices(inst, &count, &phys_dev) < 0 || !count)
+   {
+      fprintf(stderr, "No mock ICDs? Set VK_ICD_FILENAMES.\n");
+      _exit(1);
+   }
+   const auto gipa_features = (PFN_vkGetPhysicalDeviceFeatures)
+      vkGetInstanceProcAddr(inst, "vkGetPhysicalDeviceFeatures");
+   const auto gipa_format_props = (PFN_vkGetPhysicalDeviceFormatProperties)
+      vkGetInstanceProcAddr(inst, "vkGetPhysicalDeviceFormatProperties");
+
+   VkPhysicalDeviceFeatures features;
+   VkFormatProperties format_props;
+   printf("   VK_TINY_LOADER_PASSTHROUGH=%s:\n", passthrough_setting);
+   printf("      export vkGetPhysicalDeviceFeatures:         %6.2f ns\n",
+          ns_per_call([&]() { vkGetPhysicalDeviceFeatures(phys_dev, &features); }));
+   printf("      GIPA   vkGetPhysicalDeviceFeatures:         %6.2f ns\n",
+          ns_per_call([&]() { gipa_features(phys_dev, &features); }));
+   printf("      export vkGetPhysicalDeviceFormatProperties: %6.2f ns\n",
+          ns_per_call([&]() {
+      vkGetPhysicalDeviceFormatProperties(phys_dev, VK_FORMAT_UNDEFINED, &format_props);
+   }));
+   printf("      GIPA   vkGetPhysicalDeviceFormatProperties: %6.2f ns\n",
+          ns_per_call([&]() {
+      gipa_format_props(phys_dev, VK_FORMAT_UNDEFINED, &format_props);
+   }));
+   vkDestroyInstance(inst, nullptr);
+}
+
+int
+main(const int, const char* const argv[])
+{
+   use_mock_icds(argv[0], true);
+   printf("Per call, with one ICD:\n");
+   in_child_process([]() { run("1"); });
+   in_child_process([]() { run("0"); });
+   return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef BENCH_UTILS_H
+#define BENCH_UTILS_H
+
+#include "vulkan/vulkan.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// For the benchmarks in bench/, which build.sh links against the static loader.
+
+inline double
+now_secs()
+{
+   const auto now = std::chrono::steady_clock::now().time_since_epoch();
+   return std::chrono::duration<double>(now).count();
+}
+
+inline void
+sleep_secs(const double secs)
+{
+   std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+}
+
+// Unless VK_ICD_FILENAMES says otherwise, use mock ICDs A and B (or just A) from
+// next to the benchmark, and leave the user's caps cache alone. Call before the
+// first Vulkan call.
+inline void
+use_mock_icds(const char* const argv0, const bool just_a = false)
+{
+   std::string dir = argv0;
+   const auto slash = dir.find_last_of('/');
+   dir = (slash == std::string::npos) ? "." : dir.substr(0, slash);
+   auto icds = dir + "/mock_icd_a.json";
+   if (!just_a) {
+      icds += ":" + dir + "/mock_icd_b.json";
+   }
+   setenv("VK_ICD_FILENAMES", icds.c_str(), 0);
+   setenv("VK_TINY_LOADER_CAPS_CACHE", "0", 0);
+}
+
+// For loader settings that are read only once: Runs `fn` in a child process of
+// its own, and waits for it.
+template<typename FnT>
+inline void
+in_child_process(const FnT& fn)
+{
+   fflush(stdout);
+   const auto pid = fork();
+   if (pid) {
+      int status;
+      (void)waitpid(pid, &status, 0);
+      return;
+   }
+   fn();
+   fflush(stdout);
+   _exit(0);
+}
+
+#endif // BENCH_UTILS_H
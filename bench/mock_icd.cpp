@@ -0,0 +1,316 @@
+#include "vulkan/vulkan.h"
+#include "vulkan/vk_icd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+/* A driver that does next to nothing, for the benchmarks in bench/. build.sh
+ * builds it twice, as mock A and mock B, each with a manifest next to it.
+ * Knobs, read on each call, so that benchmarks can change them as they go:
+ *    MOCK_ICD_DEVICES: Physical devices per instance. (default 1, at most 4)
+ *    MOCK_ICD_LOAD_MS: Sleep in interface negotiation, like a driver that
+ *       initializes a lot when loaded.
+ *    MOCK_ICD_UNLOAD_MS: Sleep when unloaded.
+ *    MOCK_ICD_CALL_MS: Sleep in vkCreateInstance and in each instance's first
+ *       vkEnumeratePhysicalDevices, like drivers that set up kernel contexts
+ *       there.
+ *    MOCK_ICD_FAIL_CREATE=1: Fail vkCreateInstance.
+ *    MOCK_ICD_QUERY_NS: Spin in each physical-device query, like a driver that
+ *       works out its answers each time. Read once, when loaded.
+ * MOCK_ICD_<NAME>_<knob> (e.g. MOCK_ICD_B_LOAD_MS) only applies to that mock.
+ */
+
+#ifndef MOCK_ICD_NAME
+#define MOCK_ICD_NAME "A"
+#endif
+
+#ifdef _WIN32
+#define MOCK_EXPORT extern "C" __declspec(dllexport)
+#else
+#define MOCK_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+static int
+knob(const char* const name, const int fallback)
+{
+   const auto mine = std::string("MOCK_ICD_") + MOCK_ICD_NAME + "_" + name;
+   auto env = getenv(mine.c_str());
+   if (!env) {
+      env = getenv((std::string("MOCK_ICD_") + name).c_str());
+   }
+   if (!env || !*env)
+      return fallback;
+   return atoi(env);
+}
+
+static void
+sleep_ms(const int ms)
+{
+   if (ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+   }
+}
+
+static const int s_query_ns = knob("QUERY_NS", 0);
+
+static void
+query_work()
+{
+   if (!s_query_ns)
+      return;
+   const auto until = std::chrono::steady_clock::now() +
+                      std::chrono::nanoseconds(s_query_ns);
+   while (std::chrono::steady_clock::now() < until) {}
+}
+
+// -
+
+struct Object final
+{
+   VK_LOADER_DATA loader_data;
+   uint32_t id = 0;
+};
+
+static Object*
+new_object(const uint32_t id)
+{
+   const auto ret = new Object;
+   set_loader_magic_value(ret);
+   ret->id = id;
+   return ret;
+}
+
+constexpr uint32_t MAX_PHYS_DEVS = 4;
+
+struct MockInstance final
+{
+   Object object;
+   Object phys_devs[MAX_PHYS_DEVS];
+   bool enumerated = false;
+};
+
+// -
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+mock_EnumerateInstanceVersion(uint32_t* const out)
+{
+   *out = VK_API_VERSION_1_3;
+   return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+mock_EnumerateInstanceExtensionProperties(const char* const layer_name,
+                                          uint32_t* const count,
+                                          VkExtensionProperties* const props)
+{
+   if (layer_name)
+      return VK_ERROR_LAYER_NOT_PRESENT;
+   if (!props) {
+      *count = 1;
+      return VK_SUCCESS;
+   }
+   if (!*count)
+      return VK_INCOMPLETE;
+   strcpy(props[0].extensionName, VK_KHR_SURFACE_EXTENSION_NAME);
+   props[0].specVersion = VK_KHR_SURFACE_SPEC_VERSION;
+   *count = 1;
+   return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+mock_CreateInstance(const VkInstanceCreateInfo*, const VkAllocationCallbacks*,
+                    VkInstance* const out)
+{
+   sleep_ms(knob("CALL_MS", 0));
+   if (knob("FAIL_CREATE", 0))
+      return VK_ERROR_INITIALIZATION_FAILED;
+
+   const auto inst = new MockInstance;
+   set_loader_magic_value(&inst->object);
+   for (uint32_t i = 0; i < MAX_PHYS_DEVS; i++) {
+      set_loader_magic_value(&inst->phys_devs[i]);
+      inst->phys_devs[i].id = i;
+   }
+   *out = (VkInstance)inst;
+   return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+mock_DestroyInstance(const VkInstance inst, const VkAllocationCallbacks*)
+{
+   delete (MockInstance*)inst;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+mock_EnumeratePhysicalDevices(const VkInstance inst, uint32_t* const count,
+                              VkPhysicalDevice* const out)
+{
+   auto& enumerated = ((MockInstance*)inst)->enumerated;
+   if (!enumerated) {
+      sleep_ms(knob("CALL_MS", 0));
+      enumerated = true;
+   }
+
+   const auto total = std::min<uint32_t>(knob("DEVICES", 1), MAX_PHYS_DEVS);
+   if (!out) {
+      *count = total;
+      return VK_SUCCESS;
+   }
+   const auto to_write = std::min(*count, total);
+   for (uint32_t i = 0; i < to_write; i++) {
+      out[i] = (VkPhysicalDevice)&((MockInstance*)inst)->phys_devs[i];
+   }
+   *count = to_write;
+   return to_write < total ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+mock_GetPhysicalDeviceProperties(const VkPhysicalDevice phys_dev,
+                                 VkPhysicalDeviceProperties* const out)
+{
+   query_work();
+   *out = {};
+   out->apiVersion = VK_API_VERSION_1_3;
+   out->vendorID = 0x10005; // VK_VENDOR_ID_MESA
+   out->deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU;
+   snprintf(out->deviceName, sizeof(out->deviceName), "Mock %s-%u", MOCK_ICD_NAME,
+            ((Object*)phys_dev)->id);
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+mock_GetPhysicalDeviceFeatures(VkPhysicalDevice, VkPhysicalDeviceFeatures* const out)
+{
+   *out = {};
+   out->robustBufferAccess = VK_TRUE;
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+mock_GetPhysicalDeviceFormatProperties(VkPhysicalDevice, const VkFormat format,
+                                       VkFormatProperties* const out)
+{
+   query_work();
+   *out = {};
+   if (format != VK_FORMAT_UNDEFINED) {
+      out->optimalTilingFeatures = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+   }
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+mock_GetPhysicalDeviceQueueFamilyProperties(VkPhysicalDevice, uint32_t* const count,
+                                            VkQueueFamilyProperties* const out)
+{
+   query_work();
+   if (!out) {
+      *count = 1;
+      return;
+   }
+   if (!*count)
+      return;
+   out[0] = {};
+   out[0].queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+   out[0].queueCount = 1;
+   *count = 1;
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+mock_GetPhysicalDeviceMemoryProperties(VkPhysicalDevice,
+                                       VkPhysicalDeviceMemoryProperties* const out)
+{
+   query_work();
+   *out = {};
+   out->memoryTypeCount = 1;
+   out->memoryHeapCount = 1;
+   out->memoryHeaps[0].size = 1 << 30;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+mock_EnumerateDeviceExtensionProperties(VkPhysicalDevice, const char*,
+                                        uint32_t* const count, VkExtensionProperties*)
+{
+   *count = 0;
+   return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+mock_CreateDevice(const VkPhysicalDevice phys_dev, const VkDeviceCreateInfo*,
+                  const VkAllocationCallbacks*, VkDevice* const out)
+{
+   *out = (VkDevice)new_object(((Object*)phys_dev)->id);
+   return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+mock_DestroyDevice(const VkDevice dev, const VkAllocationCallbacks*)
+{
+   delete (Object*)dev;
+}
+
+// -
+
+#define FOR_EACH_DEVICE_FN(X) \
+   X(DestroyDevice)
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
+mock_GetDeviceProcAddr(VkDevice, const char* const name)
+{
+#define _(x) if (strcmp(name, "vk" #x) == 0) return (PFN_vkVoidFunction)mock_##x;
+   FOR_EACH_DEVICE_FN(_)
+   _(GetDeviceProcAddr)
+#undef _
+   return nullptr;
+}
+
+#define FOR_EACH_INSTANCE_FN(X) \
+   X(EnumerateInstanceVersion) \
+   X(EnumerateInstanceExtensionProperties) \
+   X(CreateInstance) \
+   X(DestroyInstance) \
+   X(EnumeratePhysicalDevices) \
+   X(GetPhysicalDeviceProperties) \
+   X(GetPhysicalDeviceFeatures) \
+   X(GetPhysicalDeviceFormatProperties) \
+   X(GetPhysicalDeviceQueueFamilyProperties) \
+   X(GetPhysicalDeviceMemoryProperties) \
+   X(EnumerateDeviceExtensionProperties) \
+   X(CreateDevice) \
+   X(GetDeviceProcAddr)
+
+MOCK_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
+vk_icdGetInstanceProcAddr(VkInstance, const char* const name)
+{
+#define _(x) if (strcmp(name, "vk" #x) == 0) return (PFN_vkVoidFunction)mock_##x;
+   FOR_EACH_INSTANCE_FN(_)
+   FOR_EACH_DEVICE_FN(_)
+#undef _
+   return nullptr;
+}
+
+MOCK_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
+vk_icdGetPhysicalDeviceProcAddr(VkInstance, const char*)
+{
+   return nullptr; // No physical-device extensions.
+}
+
+MOCK_EXPORT VKAPI_ATTR VkResult VKAPI_CALL
+vk_icdNegotiateLoaderICDInterfaceVersion(uint32_t* const version)
+{
+   sleep_ms(knob("LOAD_MS", 0));
+   *version = std::min<uint32_t>(*version, 5);
+   return VK_SUCCESS;
+}
+
+// -
+
+struct UnloadDelay final
+{
+   ~UnloadDelay() {
+      sleep_ms(knob("UNLOAD_MS", 0));
+   }
+};
+
+static UnloadDelay s_unload_delay;
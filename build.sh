@@ -1,4 +1,42 @@
 mkdir out 2>/dev/null
-args="-framework CoreFoundation"
-#args="Advapi32.lib"
-$CXX --std=c++14 dyn_lib.cpp dump_icds.cpp find_icds.cpp tjson_cpp/tjson.cpp utils.cpp -o out/dump_icds $args $@
+case "$(uname -s)" in
+   Darwin) args="-framework CoreFoundation" ;;
+   MINGW*|MSYS*|CYGWIN*) args="Advapi32.lib" ;;
+   *) args="-ldl -lpthread -lrt" ;; # -lrt for shm_open, before glibc 2.34.
+esac
+$CXX --std=c++14 -IVulkan-Headers/include dump_icds.cpp dyn_lib.cpp elf_preflight.cpp find_icds.cpp icd_caps_cache.cpp sealed_config.cpp tjson_cpp/tjson.cpp utils.cpp -o out/dump_icds $args $@
+$CXX --std=c++14 -IVulkan-Headers/include dump_trace.cpp api_trace.cpp utils.cpp -o out/dump_trace $args $@
+
+# out/libvk_tiny_loader.a: The loader itself, for apps to link directly instead of
+# dlopen'ing a libvulkan. Everything is hidden, so with e.g. `AR=gcc-ar ./build.sh
+# -O2 -flto`, LTO can inline the entrypoints into their callers.
+# VKTL_PREFIX=myapp_ ./build.sh renames the vk* entrypoints. (see loader_exports.h)
+# Apps link it with -ldl -lpthread, and -lrt before glibc 2.34. (macOS: -framework
+# CoreFoundation)
+lib_srcs="api_trace.cpp dyn_lib.cpp elf_preflight.cpp find_icds.cpp icd_caps_cache.cpp sealed_config.cpp tjson_cpp/tjson.cpp tramp_pool.cpp utils.cpp vk_new.cpp vk_tiny_loader.cpp"
+lib_args="-DVKTL_STATIC -fvisibility=hidden -fvisibility-inlines-hidden"
+if [ -n "$VKTL_PREFIX" ]; then
+   lib_args="$lib_args -DVKTL_PREFIX=$VKTL_PREFIX"
+fi
+rm -rf out/lib_obj
+mkdir out/lib_obj
+for src in $lib_srcs; do
+   $CXX --std=c++14 -IVulkan-Headers/include -c $src -o out/lib_obj/$(basename $src .cpp).o $lib_args $@ || exit 1
+done
+rm -f out/libvk_tiny_loader.a
+${AR:-ar} rcs out/libvk_tiny_loader.a out/lib_obj/*.o
+
+# out/bench/: Benchmarks against mock ICDs A and B, built from bench/mock_icd.cpp
+# and linked with the static loader above. Run them from anywhere, e.g.
+# `out/bench/bench_instances`.
+if [ -z "$VKTL_PREFIX" ]; then
+   mkdir -p out/bench
+   for name in a b; do
+      NAME=$(echo $name | tr a-z A-Z)
+      $CXX --std=c++14 -IVulkan-Headers/include -shared -fPIC -DMOCK_ICD_NAME=\"$NAME\" bench/mock_icd.cpp -o out/bench/libmock_icd_$name.so $@ || exit 1
+      echo "{\"file_format_version\": \"1.0.0\", \"ICD\": {\"library_path\": \"./libmock_icd_$name.so\", \"api_version\": \"1.3.0\"}}" > out/bench/mock_icd_$name.json
+   done
+   for bench in fan_out formats instances passthrough; do
+      $CXX --std=c++14 -IVulkan-Headers/include bench/bench_$bench.cpp out/libvk_tiny_loader.a -o out/bench/bench_$bench $args $@ || exit 1
+   done
+fi
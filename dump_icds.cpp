@@ -1,23 +1,111 @@
+#include "elf_preflight.h"
 #include "find_icds.h"
+#include "icd_caps_cache.h"
+#include "sealed_config.h"
 
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 
+/* dump_icds [--emit-config <path> [--include-bad]]
+ * --emit-config: Also seal the accepted ICDs into a config for the loader. (see
+ *    sealed_config.h) Global extension lists are included where the caps cache
+ *    already has them, so run something on the loader once first to capture them.
+ * --include-bad: Also seal ICDs that are known bad or unloadable, which are left
+ *    out otherwise, since the loader would just fail to load them on every run.
+ */
 int
 main(const int argc, const char* const argv[])
 {
-   const auto icd_paths = enum_icd_paths();
-   for (const auto& path : icd_paths) {
-      printf("%s:\n", path.c_str());
+   const char* config_path = nullptr;
+   bool include_bad = false;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--emit-config") == 0 && i + 1 < argc) {
+         config_path = argv[++i];
+         continue;
+      }
+      if (strcmp(argv[i], "--include-bad") == 0) {
+         include_bad = true;
+         continue;
+      }
+      fprintf(stderr, "Usage: %s [--emit-config <path> [--include-bad]]\n", argv[0]);
+      return 1;
+   }
 
-      std::string err;
-      const auto icd = IcdInfo::from(path, &err);
+   std::vector<SealedIcd> sealed;
+   const auto filter = IcdFilter::from_env();
+   IcdDedup dedup;
+   for_each_icd_info([&](const std::string& path, const IcdInfo* const icd,
+                         const std::string& err)
+   {
+      printf("%s:\n", path.c_str());
+      std::string reason;
+      bool is_bad = false;
+      if (fail_cache_find(path, &reason)) {
+         printf("   Known bad: %s\n", reason.c_str());
+         is_bad = true;
+      }
       if (!icd) {
          printf("   Error: %s\n", err.c_str());
-         continue;
+         return true;
       }
       printf("   Vulkan %s\n", icd->vk_api_version.c_str());
       printf("   %s\n", icd->library_path.c_str());
+      if (fail_cache_find(icd->library_path, &reason)) {
+         printf("   Known bad: %s\n", reason.c_str());
+         is_bad = true;
+      }
+      std::vector<std::string> exports;
+      std::string elf_err;
+      if (!elf_preflight(icd->library_path, &exports, &elf_err)) {
+         printf("   Unloadable: %s\n", elf_err.c_str());
+         is_bad = true;
+      } else if (exports.size()) {
+         std::string list;
+         for (const auto& name : exports) {
+            list += (list.size() ? ", " : "") + name;
+         }
+         printf("   Exports %s\n", list.c_str());
+      }
+      if (!filter.accepts(*icd)) {
+         printf("   Skipped by filter.\n");
+         return true;
+      }
+      std::string first;
+      if (!dedup.add(*icd, &first)) {
+         printf("   Duplicate of %s.\n", first.c_str());
+         return true;
+      }
+
+      if (config_path && is_bad && !include_bad) {
+         printf("   Not sealed. (see --include-bad)\n");
+         return true;
+      }
+      if (config_path) {
+         SealedIcd entry;
+         entry.info = *icd;
+         if (!FileId::from(icd->json_path, &entry.json_id))
+            return true;
+         (void)FileId::from(icd->library_path, &entry.lib_id);
+         entry.caps = caps_cache_load(icd->library_path);
+         if (entry.caps) {
+            printf("   Sealed, with %zu instance extensions.\n",
+                   entry.caps->instance_exts.size());
+         } else {
+            printf("   Sealed.\n");
+         }
+         sealed.push_back(std::move(entry));
+      }
+      return true;
+   });
+
+   if (config_path) {
+      std::string err;
+      if (!sealed_config_write(config_path, sealed, &err)) {
+         fprintf(stderr, "%s\n", err.c_str());
+         return 1;
+      }
+      printf("Wrote %s.\n", config_path);
    }
    return 0;
 }
@@ -0,0 +1,164 @@
+#include "api_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/* dump_trace <pid> [--last <n>] [--remove]
+ * Prints each thread's last n (default 16) calls into the loader, oldest first,
+ * from the rings of a process running with VK_TINY_LOADER_TRACE=1. (see
+ * api_trace.h) Works on hung processes as well as on what crashed ones left
+ * behind.
+ * --remove: Then remove the trace file, e.g. once a crash has been looked at.
+ */
+
+struct ResultName final
+{
+   int32_t result;
+   const char* name;
+};
+
+static const ResultName RESULT_NAMES[] = {
+   {0, "VK_SUCCESS"},
+   {1, "VK_NOT_READY"},
+   {2, "VK_TIMEOUT"},
+   {3, "VK_EVENT_SET"},
+   {4, "VK_EVENT_RESET"},
+   {5, "VK_INCOMPLETE"},
+   {-1, "VK_ERROR_OUT_OF_HOST_MEMORY"},
+   {-2, "VK_ERROR_OUT_OF_DEVICE_MEMORY"},
+   {-3, "VK_ERROR_INITIALIZATION_FAILED"},
+   {-4, "VK_ERROR_DEVICE_LOST"},
+   {-5, "VK_ERROR_MEMORY_MAP_FAILED"},
+   {-6, "VK_ERROR_LAYER_NOT_PRESENT"},
+   {-7, "VK_ERROR_EXTENSION_NOT_PRESENT"},
+   {-8, "VK_ERROR_FEATURE_NOT_PRESENT"},
+   {-9, "VK_ERROR_INCOMPATIBLE_DRIVER"},
+   {-10, "VK_ERROR_TOO_MANY_OBJECTS"},
+   {-11, "VK_ERROR_FORMAT_NOT_SUPPORTED"},
+   {-12, "VK_ERROR_FRAGMENTED_POOL"},
+};
+
+static std::string
+result_str(const int32_t result)
+{
+   for (const auto& x : RESULT_NAMES) {
+      if (x.result == result)
+         return x.name;
+   }
+   return std::to_string(result);
+}
+
+static std::string
+fn_str(const TraceMap& map, const uint16_t fn)
+{
+   if (fn < map.header().fn_count) {
+      const auto name = map.name(fn);
+      const auto len = strnlen(name, TRACE_NAME_SIZE);
+      if (len)
+         return std::string(name, len);
+   }
+   return "#" + std::to_string(fn); // Slot named after we read it.
+}
+
+static void
+dump_ring(const TraceMap& map, const TraceRing& ring, const uint64_t last,
+          const uint64_t now)
+{
+   const auto thread_id = ring.thread_id.load(std::memory_order_acquire);
+   if (!thread_id)
+      return;
+   const auto in_use = ring.in_use.load(std::memory_order_acquire);
+   const auto first = ring.first.load(std::memory_order_acquire);
+   const auto head = ring.head.load(std::memory_order_acquire);
+   printf("Thread %llu%s:\n", (unsigned long long)thread_id, in_use ? "" : " (exited)");
+
+   const auto ring_size = map.header().ring_size;
+   const auto count = std::min<uint64_t>({last, ring_size, head});
+   const auto begin = std::max(first, head - count + 1);
+   for (auto seq = begin; seq <= head; seq++) {
+      const auto& rec = map.records(ring)[(seq - 1) & (ring_size - 1)];
+      if (rec.seq.load(std::memory_order_acquire) != seq)
+         continue;
+      const auto time_ns = rec.time_ns;
+      const auto handle = rec.handle;
+      const auto fn = rec.fn;
+      const auto state = rec.state.load(std::memory_order_acquire);
+      const auto result = rec.result;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (rec.seq.load(std::memory_order_relaxed) != seq)
+         continue; // Overwritten as we read it.
+
+      const auto ago_ms = (now > time_ns) ? (now - time_ns) / 1e6 : 0.0;
+      printf("   %12.3f ms ago: %s(0x%llx)", ago_ms, fn_str(map, fn).c_str(),
+             (unsigned long long)handle);
+      switch (state) {
+      case TRACE_CALLED:
+         printf(" ... still running\n");
+         break;
+      case TRACE_RETURNED_RESULT:
+         printf(" -> %s\n", result_str(result).c_str());
+         break;
+      case TRACE_JUMPED:
+         printf(" -> (driver)\n");
+         break;
+      default:
+         printf("\n");
+         break;
+      }
+   }
+}
+
+int
+main(const int argc, const char* const argv[])
+{
+   uint64_t pid = 0;
+   uint64_t last = 16;
+   bool should_remove = false;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--last") == 0 && i + 1 < argc) {
+         last = strtoull(argv[++i], nullptr, 10);
+         continue;
+      }
+      if (strcmp(argv[i], "--remove") == 0) {
+         should_remove = true;
+         continue;
+      }
+      if (!pid) {
+         pid = strtoull(argv[i], nullptr, 10);
+         if (pid)
+            continue;
+      }
+      pid = 0;
+      break;
+   }
+   if (!pid) {
+      fprintf(stderr, "Usage: %s <pid> [--last <n>] [--remove]\n", argv[0]);
+      return 1;
+   }
+
+   std::string err;
+   const auto map = TraceMap::Open(pid, &err);
+   if (!map) {
+      fprintf(stderr, "No trace for pid %llu: %s\n", (unsigned long long)pid, err.c_str());
+      return 1;
+   }
+   const auto now = trace_now_ns();
+   const auto& header = map->header();
+   printf("pid %llu: %u rings of %u calls\n", (unsigned long long)pid,
+          header.ring_count, header.ring_size);
+   const auto untraced = header.untraced_threads.load(std::memory_order_relaxed);
+   if (untraced) {
+      printf("   %u threads untraced: Every ring was taken.\n", untraced);
+   }
+   for (uint32_t i = 0; i < header.ring_count; i++) {
+      dump_ring(*map, map->ring(i), last, now);
+   }
+
+   if (should_remove && !TraceMap::Remove(pid)) {
+      fprintf(stderr, "Couldn't remove the trace for pid %llu.\n", (unsigned long long)pid);
+      return 1;
+   }
+   return 0;
+}
@@ -12,6 +12,10 @@
 #include <dlfcn.h>
 #endif
 
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <link.h>
+#endif
+
 // -
 
 #ifdef _WIN32
@@ -26,6 +30,10 @@ class WindowsLib : public PlatformLib
    {}
 
 public:
+   ~WindowsLib() override {
+      FreeLibrary(lib_);
+   }
+
    pfn_t get_proc_address(const std::string& name) const override {
       return (pfn_t)GetProcAddress(lib_, name.c_str());
    }
@@ -33,13 +41,17 @@ public:
 
 /*static*/
 std::unique_ptr<PlatformLib>
-PlatformLib::load(const std::string& path)
+PlatformLib::load(const std::string& path, std::string* const out_err)
 {
    std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, wchar_t> utf8_to_utf16;
    const auto wpath = utf8_to_utf16.from_bytes(path);
    const auto lib = LoadLibraryW(wpath.c_str());
-   if (!lib)
+   if (!lib) {
+      if (out_err) {
+         *out_err = "LoadLibraryW failed: " + std::to_string(GetLastError());
+      }
       return nullptr;
+   }
    return as_unique(new WindowsLib(lib));
 }
 
@@ -55,6 +67,10 @@ class UnixLib : public PlatformLib
    {}
 
 public:
+   ~UnixLib() override {
+      dlclose(lib_);
+   }
+
    pfn_t get_proc_address(const std::string& name) const override {
       return (pfn_t)dlsym(lib_, name.c_str());
    }
@@ -62,12 +78,75 @@ public:
 
 /*static*/
 std::unique_ptr<PlatformLib>
-PlatformLib::load(const std::string& path)
+PlatformLib::load(const std::string& path, std::string* const out_err)
 {
    const auto lib = dlopen(path.c_str(), RTLD_LAZY);
-   if (!lib)
+   if (!lib) {
+      if (out_err) {
+         const auto err = dlerror();
+         *out_err = err ? err : "dlopen failed.";
+      }
       return nullptr;
+   }
    return as_unique(new UnixLib(lib));
 }
 
 #endif
+
+// -
+
+#if defined(__linux__) || defined(__FreeBSD__)
+
+size_t
+loaded_image_bytes()
+{
+   size_t ret = 0;
+   (void)dl_iterate_phdr([](dl_phdr_info* const info, size_t, void* const data) {
+      auto& total = *(size_t*)data;
+      for (int i = 0; i < info->dlpi_phnum; i++) {
+         const auto& phdr = info->dlpi_phdr[i];
+         if (phdr.p_type == PT_LOAD) {
+            total += phdr.p_memsz;
+         }
+      }
+      return 0;
+   }, &ret);
+   return ret;
+}
+
+#else
+
+size_t
+loaded_image_bytes()
+{
+   return 0;
+}
+
+#endif
+
+// -
+
+#ifdef _WIN32
+
+void
+pin_self()
+{
+   HMODULE mod;
+   (void)GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                               GET_MODULE_HANDLE_EX_FLAG_PIN,
+                            (LPCWSTR)&pin_self, &mod);
+}
+
+#else
+
+void
+pin_self()
+{
+   Dl_info info;
+   if (!dladdr((void*)&pin_self, &info) || !info.dli_fname)
+      return;
+   // Leaked: With RTLD_NODELETE, no dlclose unmaps it anymore, ours or anyone's.
+   (void)dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+}
+
+#endif
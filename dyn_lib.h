@@ -10,9 +10,21 @@ class PlatformLib
 public:
    typedef void (*pfn_t)();
 
-   static std::unique_ptr<PlatformLib> load(const std::string& path);
+   static std::unique_ptr<PlatformLib> load(const std::string& path,
+                                            std::string* out_err = nullptr);
+
+   // Unloads, if this was the last reference.
+   virtual ~PlatformLib() = default;
 
    virtual pfn_t get_proc_address(const std::string& name) const = 0;
 };
 
+// Sum of all currently mapped images' loadable segments, or 0 if unknown on this
+// platform. Diff across an unload to see what it reclaimed.
+size_t loaded_image_bytes();
+
+// Keeps the module this code was linked into mapped for the rest of the process,
+// even once whoever loaded it unloads it. For threads that can't be joined.
+void pin_self();
+
 #endif // DYN_LIB_H
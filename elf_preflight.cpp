@@ -0,0 +1,268 @@
+#include "elf_preflight.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#define HOST_MACHINE EM_X86_64
+#elif defined(__i386__)
+#define HOST_MACHINE EM_386
+#elif defined(__aarch64__)
+#define HOST_MACHINE EM_AARCH64
+#elif defined(__arm__)
+#define HOST_MACHINE EM_ARM
+#elif defined(__riscv)
+#define HOST_MACHINE EM_RISCV
+#elif defined(__powerpc64__)
+#define HOST_MACHINE EM_PPC64
+#else
+#define HOST_MACHINE EM_NONE // Don't check.
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_DATA ELFDATA2LSB
+#else
+#define HOST_DATA ELFDATA2MSB
+#endif
+
+static const char* const EXPORT_NAMES[] = {
+   "vk_icdGetInstanceProcAddr",
+   "vk_icdNegotiateLoaderICDInterfaceVersion",
+   "vk_icdGetPhysicalDeviceProcAddr",
+   "vkGetInstanceProcAddr",
+};
+
+// Read-only view of the whole file. Only the pages we look at get faulted in,
+// which is just the headers and the dynamic symbol table.
+class MappedFile final
+{
+   const uint8_t* data_ = nullptr;
+   size_t size_ = 0;
+
+public:
+   explicit MappedFile(const std::string& path) {
+      const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
+         return;
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+         const auto map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (map != MAP_FAILED) {
+            data_ = (const uint8_t*)map;
+            size_ = st.st_size;
+         }
+      }
+      close(fd);
+   }
+
+   ~MappedFile() {
+      if (data_) {
+         munmap((void*)data_, size_);
+      }
+   }
+
+   bool ok() const { return data_; }
+
+   // Null if out of bounds.
+   template<typename T>
+   const T* at(const uint64_t offset, const uint64_t count = 1) const {
+      if (offset > size_ || count > (size_ - offset) / sizeof(T))
+         return nullptr;
+      if (offset % alignof(T))
+         return nullptr;
+      return (const T*)(data_ + offset);
+   }
+};
+
+static uint32_t
+gnu_hash(const char* name)
+{
+   uint32_t h = 5381;
+   for (; *name; name++) {
+      h = h * 33 + uint8_t(*name);
+   }
+   return h;
+}
+
+class DynSyms final
+{
+   const MappedFile& file_;
+   const ElfW(Phdr)* phdrs_ = nullptr;
+   size_t phdr_count_ = 0;
+
+   uint64_t gnu_hash_ = 0;
+   uint64_t symtab_ = 0;
+   uint64_t strtab_ = 0;
+   uint64_t strsz_ = 0;
+
+   // To a file offset, via the PT_LOAD covering it. UINT64_MAX if none does.
+   uint64_t offset_of(const uint64_t vaddr) const {
+      for (size_t i = 0; i < phdr_count_; i++) {
+         const auto& ph = phdrs_[i];
+         if (ph.p_type != PT_LOAD)
+            continue;
+         if (vaddr >= ph.p_vaddr && vaddr - ph.p_vaddr < ph.p_filesz)
+            return ph.p_offset + (vaddr - ph.p_vaddr);
+      }
+      return UINT64_MAX;
+   }
+
+public:
+   DynSyms(const MappedFile& file, const ElfW(Ehdr)& ehdr)
+      : file_(file)
+   {
+      if (ehdr.e_phentsize != sizeof(ElfW(Phdr)))
+         return;
+      phdrs_ = file.at<ElfW(Phdr)>(ehdr.e_phoff, ehdr.e_phnum);
+      if (!phdrs_)
+         return;
+      phdr_count_ = ehdr.e_phnum;
+
+      for (size_t i = 0; i < phdr_count_; i++) {
+         const auto& ph = phdrs_[i];
+         if (ph.p_type != PT_DYNAMIC)
+            continue;
+         const auto dyns = file.at<ElfW(Dyn)>(ph.p_offset, ph.p_filesz / sizeof(ElfW(Dyn)));
+         if (!dyns)
+            return;
+         for (size_t j = 0; j < ph.p_filesz / sizeof(ElfW(Dyn)); j++) {
+            const auto& dyn = dyns[j];
+            if (dyn.d_tag == DT_NULL)
+               break;
+            switch (dyn.d_tag) {
+            case DT_GNU_HASH: gnu_hash_ = offset_of(dyn.d_un.d_ptr); break;
+            case DT_SYMTAB: symtab_ = offset_of(dyn.d_un.d_ptr); break;
+            case DT_STRTAB: strtab_ = offset_of(dyn.d_un.d_ptr); break;
+            case DT_STRSZ: strsz_ = dyn.d_un.d_val; break;
+            }
+         }
+      }
+   }
+
+   bool ok() const {
+      return gnu_hash_ && gnu_hash_ != UINT64_MAX && symtab_ && symtab_ != UINT64_MAX &&
+             strtab_ && strtab_ != UINT64_MAX && file_.at<char>(strtab_, strsz_);
+   }
+
+   bool has_export(const char* const name) const {
+      const auto header = file_.at<uint32_t>(gnu_hash_, 4);
+      if (!header)
+         return false;
+      const auto& nbuckets = header[0];
+      const auto& symoffset = header[1];
+      const auto& bloom_size = header[2];
+      const auto& bloom_shift = header[3];
+      if (!nbuckets || !bloom_size)
+         return false;
+
+      const auto bloom_offset = gnu_hash_ + 4 * sizeof(uint32_t);
+      const auto bloom = file_.at<ElfW(Addr)>(bloom_offset, bloom_size);
+      const auto buckets_offset = bloom_offset + bloom_size * sizeof(ElfW(Addr));
+      const auto buckets = file_.at<uint32_t>(buckets_offset, nbuckets);
+      if (!bloom || !buckets)
+         return false;
+      const auto chain_offset = buckets_offset + nbuckets * sizeof(uint32_t);
+
+      const auto h = gnu_hash(name);
+      constexpr uint32_t BITS = sizeof(ElfW(Addr)) * 8;
+      const auto word = bloom[(h / BITS) % bloom_size];
+      const auto mask = (ElfW(Addr)(1) << (h % BITS)) |
+                        (ElfW(Addr)(1) << ((h >> bloom_shift) % BITS));
+      if ((word & mask) != mask)
+         return false;
+
+      auto sym_i = buckets[h % nbuckets];
+      if (sym_i < symoffset)
+         return false;
+      const auto strtab = file_.at<char>(strtab_, strsz_);
+      while (true) {
+         const auto sym = file_.at<ElfW(Sym)>(symtab_ + sym_i * sizeof(ElfW(Sym)));
+         const auto chain_h = file_.at<uint32_t>(chain_offset +
+                                                 (sym_i - symoffset) * sizeof(uint32_t));
+         if (!sym || !chain_h)
+            return false;
+         if ((*chain_h | 1) == (h | 1) && sym->st_name < strsz_ &&
+             strncmp(strtab + sym->st_name, name, strsz_ - sym->st_name) == 0 &&
+             sym->st_shndx != SHN_UNDEF)
+         {
+            return true;
+         }
+         if (*chain_h & 1)
+            return false;
+         sym_i += 1;
+      }
+   }
+};
+
+bool
+elf_preflight(const std::string& lib_path, std::vector<std::string>* const out_exports,
+              std::string* const out_err)
+{
+   out_exports->clear();
+   if (lib_path.find('/') == std::string::npos)
+      return true; // For dlopen to find.
+
+   const MappedFile file(lib_path);
+   if (!file.ok())
+      return true; // Let dlopen report it.
+
+   const auto ident = file.at<unsigned char>(0, EI_NIDENT);
+   if (!ident || memcmp(ident, ELFMAG, SELFMAG) != 0)
+      return true;
+
+   constexpr auto HOST_CLASS = sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32;
+   if (ident[EI_CLASS] != HOST_CLASS) {
+      *out_err = ident[EI_CLASS] == ELFCLASS64 ? "64-bit ELF." : "32-bit ELF.";
+      return false;
+   }
+   if (ident[EI_DATA] != HOST_DATA) {
+      *out_err = "Wrong ELF byte order.";
+      return false;
+   }
+   const auto ehdr = file.at<ElfW(Ehdr)>(0);
+   if (!ehdr)
+      return true;
+   if (HOST_MACHINE != EM_NONE && ehdr->e_machine != HOST_MACHINE) {
+      *out_err = "ELF machine " + std::to_string(ehdr->e_machine) + " isn't this one (" +
+                 std::to_string(HOST_MACHINE) + ").";
+      return false;
+   }
+
+   const DynSyms syms(file, *ehdr);
+   if (!syms.ok())
+      return true;
+   for (const auto& name : EXPORT_NAMES) {
+      if (syms.has_export(name)) {
+         out_exports->push_back(name);
+      }
+   }
+   const auto has = [&](const char* const name) {
+      return std::find(out_exports->begin(), out_exports->end(), name) != out_exports->end();
+   };
+   if (!has("vk_icdGetInstanceProcAddr") && !has("vkGetInstanceProcAddr")) {
+      *out_err = "No vk_icdGetInstanceProcAddr export.";
+      return false;
+   }
+   return true;
+}
+
+#else
+
+bool
+elf_preflight(const std::string&, std::vector<std::string>* const out_exports,
+              std::string*)
+{
+   out_exports->clear();
+   return true;
+}
+
+#endif
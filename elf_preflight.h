@@ -0,0 +1,19 @@
+#ifndef ELF_PREFLIGHT_H
+#define ELF_PREFLIGHT_H
+
+#include <string>
+#include <vector>
+
+// Checks an ICD library without dlopen'ing it, so that e.g. the 32-bit half of a
+// multilib install is rejected before paying for mapping and relocation.
+//
+// False (with out_err) only if the library definitely can't work here: Wrong ELF
+// class, byte order, or machine, or no vk_icdGetInstanceProcAddr (or legacy
+// vkGetInstanceProcAddr) export. Anything it can't judge passes: Non-Linux, bare
+// library names left for dlopen to find, and libraries without DT_GNU_HASH.
+//
+// out_exports gets the vk_icd*/vkGetInstanceProcAddr exports found, if any.
+bool elf_preflight(const std::string& lib_path, std::vector<std::string>* out_exports,
+                   std::string* out_err);
+
+#endif // ELF_PREFLIGHT_H
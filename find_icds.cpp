@@ -1,7 +1,14 @@
 #include "find_icds.h"
 
+#include "dyn_lib.h"
+
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <system_error>
+#include <thread>
 #include "tjson_cpp/tjson.h"
 
 #ifdef __APPLE__
@@ -13,6 +20,7 @@
 #include "Windows.h"
 #else
 #include <dirent.h>
+#include <pthread.h>
 #endif
 
 // -
@@ -209,31 +217,255 @@ split_string(const std::string& str, const char delim)
    return ret;
 }
 
-std::vector<std::string>
-enum_icd_paths()
+// -
+
+using Clock = std::chrono::steady_clock;
+
+static uint32_t
+to_ms(const Clock::duration d)
 {
-   std::vector<std::string> ret;
+   return uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+}
 
-   // --
+static std::chrono::milliseconds
+env_ms(const char* const name, const uint32_t default_ms)
+{
+   const auto env = getenv(name);
+   const auto ms = (env && *env) ? strtoul(env, nullptr, 10) : default_ms;
+   return std::chrono::milliseconds(ms);
+}
 
-   [&]() {
-      const auto env = getenv("VK_ICD_FILENAMES");
-      if (!env)
-         return;
+std::chrono::milliseconds
+scan_dir_budget()
+{
+   return env_ms("VK_TINY_LOADER_SCAN_DIR_BUDGET_MS", 1000);
+}
 
-      const auto paths = split_string(env, ':');
-      for (const auto& path : paths) {
-         ret.push_back(path);
+struct ScanBudget final
+{
+   Clock::time_point start = Clock::now();
+   Clock::duration total; // Zero if unbounded.
+   Clock::duration per_dir;
+
+   static ScanBudget from_env() {
+      ScanBudget ret;
+      ret.total = env_ms("VK_TINY_LOADER_SCAN_BUDGET_MS", 2000);
+      ret.per_dir = scan_dir_budget();
+      return ret;
+   }
+
+   // Clock::time_point::max() if unbounded.
+   Clock::time_point total_deadline() const {
+      if (!total.count())
+         return Clock::time_point::max();
+      return start + total;
+   }
+
+   Clock::time_point deadline(const Clock::time_point job_start) const {
+      auto ret = total_deadline();
+      if (per_dir.count()) {
+         ret = std::min(ret, job_start + per_dir);
       }
+      return ret;
+   }
+};
+
+struct Manifest final
+{
+   std::string path;
+   bool has_id = false; // As of before reading, for is_unchanged().
+   FileId id;
+   std::unique_ptr<std::vector<uint8_t>> bytes; // If read.
+   std::string err;
+};
+
+static Manifest
+read_manifest(const std::string& path, const bool read)
+{
+   Manifest ret;
+   ret.path = path;
+   ret.has_id = FileId::from(path, &ret.id);
+   if (read) {
+      ret.bytes = read_bytes(path, &ret.err, std::ios_base::binary);
+   }
+   return ret;
+}
+
+static const std::string JSON_EXT = ".json";
+
+static std::vector<Manifest>
+list_manifests(const std::string& dir, const bool read)
+{
+   std::vector<Manifest> ret;
+   const auto files = list_dir(dir);
+   if (!files)
+      return ret;
+
+   for (const auto& file : *files) {
+      if (!ends_with(file, JSON_EXT))
+         continue;
+      ret.push_back(read_manifest(file, read));
+   }
+   return ret;
+}
+
+// -
+
+// A dir to list, or a single manifest (VK_ICD_FILENAMES, the registry) to read.
+// Either can hang on a dead mount.
+struct ScanJob final
+{
+   std::string path;
+   bool is_dir = false;
+   bool read = false;
+
+   // The rest is guarded by scan_mutex(), until done. Done jobs don't change.
+   bool claimed = false;
+   bool done = false;
+   Clock::time_point start; // Once claimed.
+   Clock::duration took{};
+   bool has_id = false; // Of `path`, as of before scanning.
+   FileId id;
+   std::vector<Manifest> manifests;
+};
+
+// Whether a done job still holds: Its path, and every manifest it found, are
+// the same files as when it scanned them. Stats them, so call without
+// scan_mutex().
+static bool
+is_unchanged(const ScanJob& job)
+{
+   const auto fn_same = [](const std::string& path, const bool had_id,
+                           const FileId& old_id)
+   {
+      FileId id;
+      const bool has_id = FileId::from(path, &id);
+      return has_id == had_id && (!has_id || id == old_id);
+   };
+   if (!fn_same(job.path, job.has_id, job.id))
+      return false;
+   for (const auto& manifest : job.manifests) {
+      if (!fn_same(manifest.path, manifest.has_id, manifest.id))
+         return false;
+   }
+   return true;
+}
+
+// A scan's jobs, in order, which its worker threads claim one at a time.
+struct ScanBatch final
+{
+   std::vector<std::shared_ptr<ScanJob>> jobs;
+
+   // Guarded by scan_mutex():
+   size_t next = 0;
+   bool stopped = false;
+   std::condition_variable cv;
+};
+
+struct ScanWorker final
+{
+   std::thread thread;
+   std::shared_ptr<ScanJob> job; // Guarded by scan_mutex(). Null between jobs.
+};
+
+// Jobs that scans abandoned, by path, until a later scan picks up what they
+// found. Until then, scans skip their path, rather than pile more threads onto a
+// hung mount. Guarded by scan_mutex(), and never destroyed either.
+static std::unordered_map<std::string, std::shared_ptr<ScanJob>>&
+abandoned_jobs()
+{
+   static auto& ret = *new std::unordered_map<std::string, std::shared_ptr<ScanJob>>;
+   return ret;
+}
+
+// Jobs that finished within budget, by path, for later scans to reuse for as long
+// as they're is_unchanged(), so that e.g. every vkCreateInstance doesn't rescan.
+// Guarded by scan_mutex(), and never destroyed either.
+static std::unordered_map<std::string, std::shared_ptr<ScanJob>>&
+scan_cache()
+{
+   static auto& ret = *new std::unordered_map<std::string, std::shared_ptr<ScanJob>>;
+   return ret;
+}
+
+// Never destroyed, since abandoned workers can outlive everything else.
+static std::mutex&
+scan_mutex()
+{
+   static auto& ret = *[]() {
+      const auto mutex = new std::mutex;
+#ifndef _WIN32
+      // Don't fork while a worker holds it. Abandoned workers don't exist in the
+      // child, so it forgets their jobs, and scans those paths again itself.
+      (void)pthread_atfork([]() { scan_mutex().lock(); },
+                           []() { scan_mutex().unlock(); },
+                           []() {
+         auto& abandoned = abandoned_jobs();
+         for (auto itr = abandoned.begin(); itr != abandoned.end();) {
+            if (itr->second->done) {
+               ++itr;
+               continue;
+            }
+            itr = abandoned.erase(itr);
+         }
+         scan_mutex().unlock();
+      });
+#endif
+      return mutex;
    }();
+   return ret;
+}
+
+static void
+run_scan_worker(ScanBatch& batch, ScanWorker& worker)
+{
+   std::unique_lock<std::mutex> lock(scan_mutex());
+   while (!batch.stopped && batch.next < batch.jobs.size()) {
+      const auto job = batch.jobs[batch.next++];
+      if (job->claimed)
+         continue; // Already done, by an earlier scan.
+      job->claimed = true;
+      job->start = Clock::now();
+      worker.job = job;
+      lock.unlock();
+
+      FileId id;
+      const bool has_id = FileId::from(job->path, &id);
+      std::vector<Manifest> manifests;
+      if (job->is_dir) {
+         manifests = list_manifests(job->path, job->read);
+      } else {
+         manifests.push_back(read_manifest(job->path, job->read));
+      }
+
+      lock.lock();
+      job->took = Clock::now() - job->start;
+      job->has_id = has_id;
+      job->id = id;
+      job->manifests = std::move(manifests);
+      job->done = true;
+      worker.job = nullptr;
+      batch.cv.notify_all();
+   }
+}
+
+static void
+scan_icd_manifests(const bool read, const std::function<bool(const Manifest&)>& fn)
+{
+   const auto budget = ScanBudget::from_env();
+   std::vector<std::string> icd_paths;
+
+   const auto env = getenv("VK_ICD_FILENAMES");
+   if (env) {
+      icd_paths = split_string(env, ':');
+   }
 
    // --
 
 #ifdef _WIN32
    const auto wpaths = load_from_registry();
    for (const auto& wpath : wpaths) {
-      auto path = to_string(wpath);
-      ret.push_back(std::move(path));
+      icd_paths.push_back(to_string(wpath));
    }
 #endif // _WIN32
 
@@ -294,32 +526,226 @@ enum_icd_paths()
    }();
 #endif // !_WIN32
 
-   static const std::string JSON_EXT = ".json";
-
+   std::vector<std::pair<std::string, bool>> paths; // With is_dir.
+   for (const auto& path : icd_paths) {
+      paths.push_back({ path, false });
+   }
    for (const auto& dir : icd_dirs) {
-      const auto files = list_dir(dir);
-      if (!files)
-         continue;
+      paths.push_back({ dir, true });
+   }
 
-      for (const auto& file : *files) {
-         if (!ends_with(file, JSON_EXT))
+   // Paths that an earlier scan got through in time, and that haven't changed
+   // since, are reused as they are.
+   std::vector<std::shared_ptr<ScanJob>> cached(paths.size());
+   {
+      const std::lock_guard<std::mutex> lock(scan_mutex());
+      for (size_t i = 0; i < paths.size(); i++) {
+         const auto& path = paths[i].first;
+         if (abandoned_jobs().count(path))
+            continue; // Don't stat it while it's hung.
+         const auto itr = scan_cache().find(path);
+         if (itr != scan_cache().end() && (itr->second->read || !read)) {
+            cached[i] = itr->second;
+         }
+      }
+   }
+   for (auto& job : cached) {
+      if (job && !is_unchanged(*job)) {
+         job = nullptr;
+      }
+   }
+
+   // Every other path goes on the clock, in order, on a worker thread. Where one
+   // overruns, it's abandoned to its worker, and a new worker takes on the rest.
+   const auto batch = std::make_shared<ScanBatch>();
+   bool needs_worker = false;
+   {
+      const std::lock_guard<std::mutex> lock(scan_mutex());
+      const auto fn_add = [&](const std::string& path, const bool is_dir,
+                              const std::shared_ptr<ScanJob>& cached_job)
+      {
+         if (cached_job) {
+            batch->jobs.push_back(cached_job);
+            return;
+         }
+         auto& abandoned = abandoned_jobs();
+         const auto itr = abandoned.find(path);
+         if (itr != abandoned.end()) {
+            const auto late = itr->second;
+            if (!late->done) {
+               debug_log("Skipped ICD path %s: Still hung, after %u ms.", path.c_str(),
+                         to_ms(Clock::now() - late->start));
+               return;
+            }
+            abandoned.erase(itr);
+            if (late->read == read) {
+               batch->jobs.push_back(late); // It did finish, so use that.
+               return;
+            }
+         }
+         const auto job = std::make_shared<ScanJob>();
+         job->path = path;
+         job->is_dir = is_dir;
+         job->read = read;
+         batch->jobs.push_back(job);
+         needs_worker = true;
+      };
+      for (size_t i = 0; i < paths.size(); i++) {
+         fn_add(paths[i].first, paths[i].second, cached[i]);
+      }
+   }
+
+   std::vector<std::shared_ptr<ScanWorker>> workers;
+   const auto fn_spawn = [&]() {
+      const auto worker = std::make_shared<ScanWorker>();
+      try {
+         worker->thread = std::thread([batch, worker]() {
+            run_scan_worker(*batch, *worker);
+         });
+      } catch (const std::system_error&) {
+         run_scan_worker(*batch, *worker); // In place, and unbudgeted.
+         return;
+      }
+      workers.push_back(worker);
+   };
+
+   if (needs_worker) {
+      fn_spawn();
+   }
+   [&]() {
+      std::unique_lock<std::mutex> lock(scan_mutex());
+      for (const auto& job : batch->jobs) {
+         while (!job->done) {
+            const auto deadline = job->claimed ? budget.deadline(job->start)
+                                               : budget.total_deadline();
+            if (deadline == Clock::time_point::max()) {
+               batch->cv.wait(lock);
+            } else if (batch->cv.wait_until(lock, deadline) == std::cv_status::timeout &&
+                       Clock::now() >= deadline) {
+               break;
+            }
+         }
+         if (!job->done) {
+            if (!job->claimed) {
+               debug_log("Skipped ICD path %s: Out of budget.", job->path.c_str());
+               continue;
+            }
+            debug_log("Abandoned ICD path %s: Still scanning after %u ms.",
+                      job->path.c_str(), to_ms(Clock::now() - job->start));
+            abandoned_jobs()[job->path] = job;
+            scan_cache().erase(job->path);
+            if (batch->next < batch->jobs.size() &&
+                Clock::now() < budget.total_deadline())
+            {
+               lock.unlock();
+               fn_spawn();
+               lock.lock();
+            }
+            continue;
+         }
+
+         if (!budget.per_dir.count() || job->took < budget.per_dir) {
+            scan_cache()[job->path] = job;
+         }
+         lock.unlock();
+         for (const auto& manifest : job->manifests) {
+            if (!fn(manifest))
+               return;
+         }
+         lock.lock();
+      }
+   }();
+
+   // Workers still on a job are abandoned with it, and pin us, so that they're
+   // never left running unmapped code. The rest are done, or about to be.
+   bool pin = false;
+   {
+      const std::lock_guard<std::mutex> lock(scan_mutex());
+      batch->stopped = true;
+      for (const auto& worker : workers) {
+         if (!worker->job)
             continue;
-         ret.push_back(file);
+         (void)abandoned_jobs().insert({worker->job->path, worker->job});
+         worker->thread.detach();
+         pin = true;
       }
    }
+   if (pin) {
+      pin_self();
+   }
+   for (const auto& worker : workers) {
+      if (worker->thread.joinable()) {
+         worker->thread.join();
+      }
+   }
+
+   const auto took_ms = to_ms(Clock::now() - budget.start);
+   if (budget.total.count() && took_ms > to_ms(budget.total)) {
+      debug_log("ICD discovery took %u ms, over its %u ms budget.", took_ms,
+                to_ms(budget.total));
+   }
+}
 
+void
+for_each_icd_path(const std::function<bool(const std::string&)>& fn)
+{
+   scan_icd_manifests(false, [&](const Manifest& manifest) {
+      return fn(manifest.path);
+   });
+}
+
+void
+for_each_icd_manifest(const std::function<bool(const std::string& json_path,
+                                               const std::vector<uint8_t>* bytes,
+                                               const std::string& err)>& fn)
+{
+   scan_icd_manifests(true, [&](const Manifest& manifest) {
+      return fn(manifest.path, manifest.bytes.get(), manifest.err);
+   });
+}
+
+std::vector<std::string>
+enum_icd_paths()
+{
+   std::vector<std::string> ret;
+   for_each_icd_path([&](const std::string& path) {
+      ret.push_back(path);
+      return true;
+   });
    return ret;
 }
 
+void
+for_each_icd_info(const std::function<bool(const std::string& json_path,
+                                           const IcdInfo* info,
+                                           const std::string& err)>& fn)
+{
+   for_each_icd_manifest([&](const std::string& path, const std::vector<uint8_t>* const bytes,
+                             const std::string& read_err)
+   {
+      if (!bytes)
+         return fn(path, nullptr, read_err);
+      std::string err;
+      const auto info = IcdInfo::from_bytes(path, *bytes, &err);
+      return fn(path, info.get(), err);
+   });
+}
+
 /*static*/ std::unique_ptr<IcdInfo>
 IcdInfo::from(const std::string& json_path, std::string* const err)
 {
    const auto bytes = read_bytes(json_path, err, std::ios_base::binary);
    if (!bytes)
       return nullptr;
+   return from_bytes(json_path, *bytes, err);
+}
 
-   const auto json = tjson::read((const char*)bytes->data(),
-                                 (const char*)bytes->data() + bytes->size(), err);
+/*static*/ std::unique_ptr<IcdInfo>
+IcdInfo::from_bytes(const std::string& json_path, const std::vector<uint8_t>& bytes,
+                    std::string* const err)
+{
+   const auto json = tjson::read((const char*)bytes.data(),
+                                 (const char*)bytes.data() + bytes.size(), err);
    /* icd.d/<*>.json
    {
       "file_format_version": "1.0.0",
@@ -361,3 +787,88 @@ IcdInfo::from(const std::string& json_path, std::string* const err)
    ret->vk_api_version = api_version;
    return ret;
 }
+
+// -
+
+bool
+IcdDedup::add(const IcdInfo& info, std::string* const out_first)
+{
+   const auto& name = info.json_path.size() ? info.json_path : info.library_path;
+   std::string ids[2];
+   if (info.json_path.size()) {
+      ids[0] = "json:" + file_identity(info.json_path);
+   }
+   const auto& lib = info.library_path;
+   if (path_filename(lib) == lib) {
+      ids[1] = "lib-name:" + lib;
+   } else {
+      ids[1] = "lib:" + file_identity(lib);
+   }
+
+   for (const auto& id : ids) {
+      if (!id.size())
+         continue;
+      const auto itr = first_by_id_.find(id);
+      if (itr != first_by_id_.end()) {
+         *out_first = itr->second;
+         return false;
+      }
+   }
+   for (const auto& id : ids) {
+      if (id.size()) {
+         first_by_id_[id] = name;
+      }
+   }
+   return true;
+}
+
+// -
+
+/*static*/ IcdFilter
+IcdFilter::from_env()
+{
+   IcdFilter ret;
+   const auto fn_list = [&](const char* const name, std::vector<std::string>* const out) {
+      const auto env = getenv(name);
+      if (!env || !*env)
+         return;
+      *out = split_string(env, ':');
+   };
+   fn_list("VK_TINY_LOADER_ALLOW_JSON", &ret.allow_json_paths);
+   fn_list("VK_TINY_LOADER_DENY_JSON", &ret.deny_json_paths);
+   fn_list("VK_TINY_LOADER_ALLOW_LIB", &ret.allow_library_names);
+   fn_list("VK_TINY_LOADER_DENY_LIB", &ret.deny_library_names);
+   fn_list("VK_TINY_LOADER_ALLOW_API", &ret.allow_api_versions);
+   fn_list("VK_TINY_LOADER_DENY_API", &ret.deny_api_versions);
+   return ret;
+}
+
+static bool
+any_match(const std::vector<std::string>& patterns, const std::string& str)
+{
+   for (const auto& pattern : patterns) {
+      if (glob_match(pattern, str))
+         return true;
+   }
+   return false;
+}
+
+bool
+IcdFilter::accepts(const IcdInfo& info) const
+{
+   const auto fn_check = [](const std::vector<std::string>& allow,
+                            const std::vector<std::string>& deny,
+                            const std::string& str)
+   {
+      if (any_match(deny, str))
+         return false;
+      if (allow.size() && !any_match(allow, str))
+         return false;
+      return true;
+   };
+
+   return fn_check(allow_json_paths, deny_json_paths, info.json_path) &&
+          fn_check(allow_library_names, deny_library_names,
+                   path_filename(info.library_path)) &&
+          fn_check(allow_api_versions, deny_api_versions, info.vk_api_version);
+}
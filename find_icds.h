@@ -1,8 +1,11 @@
 #ifndef FIND_ICDS_H
 #define FIND_ICDS_H
 
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "utils.h"
@@ -15,8 +18,90 @@ struct IcdInfo final
 
    static std::unique_ptr<IcdInfo> from(const std::string& json_path,
                                         std::string* out_err);
+   static std::unique_ptr<IcdInfo> from_bytes(const std::string& json_path,
+                                              const std::vector<uint8_t>& bytes,
+                                              std::string* out_err);
 };
 
 std::vector<std::string> enum_icd_paths();
 
+// Incremental versions of enum_icd_paths(), in the same order: Each manifest is
+// handed over as soon as it's found, so callers can get going on early drivers
+// while slow directories (e.g. an NFS $HOME) are still being listed. Return false
+// from `fn` to stop scanning.
+//
+// Discovery is time-budgeted, so that a hung filesystem can't stall startup:
+// Every dir, and every manifest named directly (VK_ICD_FILENAMES), is listed or
+// read in order on a worker thread, and abandoned past its deadline. Until an
+// abandoned one finishes, later scans skip it rather than wait on it again, and
+// then use what it found. Abandoning goes to debug_log.
+// What a scan found in time is kept, and later scans reuse it without a worker
+// for as long as the path, and each manifest in it, are unchanged. (by FileId)
+/* VK_TINY_LOADER_SCAN_BUDGET_MS: For the whole scan. (default 2000)
+ * VK_TINY_LOADER_SCAN_DIR_BUDGET_MS: Per dir or named manifest. (default 1000)
+ * 0 waits as long as it takes.
+ */
+void for_each_icd_path(const std::function<bool(const std::string&)>& fn);
+
+// VK_TINY_LOADER_SCAN_DIR_BUDGET_MS, for other per-user dirs that mustn't stall
+// startup either. (see icd_caps_cache.h) Zero if unbounded.
+std::chrono::milliseconds scan_dir_budget();
+
+// With each manifest's contents, read within the budget above. `bytes` is null
+// if it couldn't be read, with `err` saying why.
+void for_each_icd_manifest(const std::function<bool(const std::string& json_path,
+                                                    const std::vector<uint8_t>* bytes,
+                                                    const std::string& err)>& fn);
+
+// `info` is null if the manifest didn't parse, with `err` saying why.
+void for_each_icd_info(const std::function<bool(const std::string& json_path,
+                                                const IcdInfo* info,
+                                                const std::string& err)>& fn);
+
+// An ICD that IcdDedup::add turned away, as a duplicate.
+struct FoldedIcd final
+{
+   std::string path; // Its json_path, or library_path if it has none.
+   std::string first; // Likewise, for the earlier ICD it duplicates.
+};
+
+// Folds ICDs whose manifest, or library, is a file already seen: The same
+// driver reached via symlinks, /usr/lib vs /usr/lib64, or both VK_ICD_FILENAMES
+// and an icd.d dir. Keyed by file_identity.
+// Bare library names (no dir) are left for dlopen to search for, so they're only
+// folded with the same bare name, and never with a full path to the same file.
+class IcdDedup final
+{
+   std::unordered_map<std::string, std::string> first_by_id_;
+
+public:
+   // False if `info` duplicates an earlier ICD, whose json_path (or
+   // library_path, if it has none) goes in out_first.
+   bool add(const IcdInfo& info, std::string* out_first);
+};
+
+// -
+
+// Decides which drivers are worth loading at all, before anything is dlopen'd.
+// Patterns are globs (see glob_match). An empty allow-list allows everything, and
+// deny-lists win over allow-lists.
+struct IcdFilter final
+{
+   std::vector<std::string> allow_json_paths;
+   std::vector<std::string> deny_json_paths;
+   std::vector<std::string> allow_library_names; // Matched against the filename only.
+   std::vector<std::string> deny_library_names;
+   std::vector<std::string> allow_api_versions; // E.g. "1.1.*"
+   std::vector<std::string> deny_api_versions;
+
+   /* VK_TINY_LOADER_ALLOW_JSON, VK_TINY_LOADER_DENY_JSON
+    * VK_TINY_LOADER_ALLOW_LIB, VK_TINY_LOADER_DENY_LIB
+    * VK_TINY_LOADER_ALLOW_API, VK_TINY_LOADER_DENY_API
+    * Each is a ':'-separated list of patterns, like VK_ICD_FILENAMES.
+    */
+   static IcdFilter from_env();
+
+   bool accepts(const IcdInfo& info) const;
+};
+
 #endif // FIND_ICDS_H
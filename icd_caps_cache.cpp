@@ -0,0 +1,535 @@
+#include "icd_caps_cache.h"
+
+#include "dyn_lib.h"
+#include "find_icds.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include "Windows.h"
+#include <direct.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <elf.h>
+#endif
+
+// -
+
+bool
+caps_cache_enabled()
+{
+   const auto env = getenv("VK_TINY_LOADER_CAPS_CACHE");
+   if (!env)
+      return true;
+   return std::string(env) != "0";
+}
+
+static std::string
+cache_dir()
+{
+#ifdef _WIN32
+   const auto env = getenv("LOCALAPPDATA");
+   if (!env)
+      return "";
+   return path_concat(env, "vk_tiny_loader");
+#else
+   std::string base;
+   const auto xdg = getenv("XDG_CACHE_HOME");
+   if (xdg && *xdg) {
+      base = xdg;
+   } else {
+      const auto home = getenv("HOME");
+      if (!home)
+         return "";
+      base = path_concat(home, ".cache");
+   }
+   return path_concat(base, "vk_tiny_loader");
+#endif
+}
+
+// -
+// $HOME can be a dead NFS mount too, so like ICD discovery (see find_icds.h), the
+// cache dir's first read is on the clock, on a worker thread, for
+// VK_TINY_LOADER_SCAN_DIR_BUDGET_MS. If it overruns, there's no cache for the rest
+// of the process: Loads miss, and stores are dropped. Stores only go ahead once a
+// read has come back in time.
+
+enum class CacheDirState { UNKNOWN, PROBING, OK, HUNG };
+
+struct CacheRead final
+{
+   std::string path;
+
+   // Guarded by cache_dir_mutex():
+   bool done = false;
+   std::unique_ptr<std::vector<uint8_t>> bytes;
+};
+
+static CacheDirState s_dir_state = CacheDirState::UNKNOWN; // Guarded by cache_dir_mutex().
+
+// Never destroyed, since an abandoned read can outlive everything else.
+static std::mutex&
+cache_dir_mutex()
+{
+   static auto& ret = *[]() {
+      const auto mutex = new std::mutex;
+#ifndef _WIN32
+      // A probe's reader doesn't exist in the child, so it probes again itself.
+      (void)pthread_atfork([]() { cache_dir_mutex().lock(); },
+                           []() { cache_dir_mutex().unlock(); },
+                           []() {
+         if (s_dir_state == CacheDirState::PROBING) {
+            s_dir_state = CacheDirState::UNKNOWN;
+         }
+         cache_dir_mutex().unlock();
+      });
+#endif
+      return mutex;
+   }();
+   return ret;
+}
+
+static std::condition_variable&
+cache_dir_cv()
+{
+   static auto& ret = *new std::condition_variable;
+   return ret;
+}
+
+// Null on a miss, or if the cache dir is hung.
+static std::unique_ptr<std::vector<uint8_t>>
+read_entry(const std::string& path)
+{
+   std::string err;
+   {
+      std::unique_lock<std::mutex> lock(cache_dir_mutex());
+      while (s_dir_state == CacheDirState::PROBING) {
+         cache_dir_cv().wait(lock); // On the prober, which is budgeted.
+      }
+      if (s_dir_state == CacheDirState::HUNG)
+         return nullptr;
+      if (s_dir_state == CacheDirState::UNKNOWN) {
+         s_dir_state = CacheDirState::PROBING;
+      } else {
+         lock.unlock();
+         return read_bytes(path, &err, std::ios_base::binary);
+      }
+   }
+
+   const auto start = std::chrono::steady_clock::now();
+   const auto budget = scan_dir_budget();
+   const auto read = std::make_shared<CacheRead>();
+   read->path = path;
+   std::thread thread;
+   try {
+      thread = std::thread([read]() {
+         std::string err;
+         auto bytes = read_bytes(read->path, &err, std::ios_base::binary);
+         const std::lock_guard<std::mutex> lock(cache_dir_mutex());
+         read->bytes = std::move(bytes);
+         read->done = true;
+         cache_dir_cv().notify_all();
+      });
+   } catch (const std::system_error&) {
+      auto bytes = read_bytes(path, &err, std::ios_base::binary); // In place, and unbudgeted.
+      const std::lock_guard<std::mutex> lock(cache_dir_mutex());
+      read->bytes = std::move(bytes);
+      read->done = true;
+   }
+
+   std::unique_lock<std::mutex> lock(cache_dir_mutex());
+   while (!read->done) {
+      if (!budget.count()) {
+         cache_dir_cv().wait(lock);
+      } else if (cache_dir_cv().wait_until(lock, start + budget) == std::cv_status::timeout) {
+         break;
+      }
+   }
+   s_dir_state = read->done ? CacheDirState::OK : CacheDirState::HUNG;
+   cache_dir_cv().notify_all();
+   lock.unlock();
+
+   if (!thread.joinable())
+      return std::move(read->bytes);
+   if (!read->done) {
+      debug_log("Not using the ICD cache: Reading %s took over %u ms.", path.c_str(),
+                uint32_t(budget.count()));
+      // Abandoned, so pin us, so that it's never left running unmapped code.
+      thread.detach();
+      pin_self();
+      return nullptr;
+   }
+   thread.join();
+   return std::move(read->bytes);
+}
+
+static bool
+is_cache_dir_ok()
+{
+   const std::lock_guard<std::mutex> lock(cache_dir_mutex());
+   return s_dir_state == CacheDirState::OK;
+}
+
+// -
+
+static void
+make_dir(const std::string& path)
+{
+#ifdef _WIN32
+   (void)_wmkdir(to_wstring(path).c_str());
+#else
+   (void)mkdir(path.c_str(), 0700);
+#endif
+}
+
+static std::string
+entry_path(const std::string& dir, const std::string& lib_path, const char* const ext = "caps")
+{
+   char name[16 + 1 + 4 + 1];
+   snprintf(name, sizeof(name), "%016llx.%s", (unsigned long long)fnv1a64(lib_path), ext);
+   return path_concat(dir, name);
+}
+
+// Write-then-rename, so concurrent readers never see a partial entry.
+static void
+write_entry(const std::string& path, const std::vector<uint8_t>& bytes)
+{
+   if (!is_cache_dir_ok())
+      return;
+   make_dir(path_parent(path_parent(path)));
+   make_dir(path_parent(path));
+
+#ifdef _WIN32
+   const auto pid = _getpid();
+#else
+   const auto pid = getpid();
+#endif
+   const auto tmp_path = path + ".tmp" + std::to_string(pid);
+   {
+      std::ofstream out(tmp_path, std::ios_base::binary | std::ios_base::trunc);
+      out.write((const char*)bytes.data(), bytes.size());
+      if (!out.good()) {
+         out.close();
+         (void)remove(tmp_path.c_str());
+         return;
+      }
+   }
+#ifdef _WIN32
+   (void)MoveFileExW(to_wstring(tmp_path).c_str(), to_wstring(path).c_str(),
+                     MOVEFILE_REPLACE_EXISTING);
+#else
+   if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+      (void)remove(tmp_path.c_str());
+   }
+#endif
+}
+
+// -
+// Entry format: (native endian, since it never leaves the machine)
+//    "VKTLCAP1"
+//    u64 dev, ino, mtime_ns, size
+//    u32 build_id_len, u8[build_id_len]
+//    u32 lib_path_len, char[lib_path_len]
+//    u32 instance_version
+//    u32 ext_count, VkExtensionProperties[ext_count]
+
+static const char MAGIC[8] = {'V','K','T','L','C','A','P','1'};
+
+// -
+
+std::unique_ptr<IcdCaps>
+caps_cache_load(const std::string& lib_path)
+{
+   FileId cur_id;
+   if (!FileId::from(lib_path, &cur_id))
+      return nullptr;
+
+   const auto dir = cache_dir();
+   if (!dir.size())
+      return nullptr;
+
+   const auto bytes = read_entry(entry_path(dir, lib_path));
+   if (!bytes)
+      return nullptr;
+
+   ByteReader reader(*bytes);
+   char magic[sizeof(MAGIC)];
+   FileId id;
+   std::vector<uint8_t> build_id;
+   std::vector<char> path;
+   auto ret = std::make_unique<IcdCaps>();
+   uint32_t ext_count;
+   if (!reader.read(magic, sizeof(magic)) ||
+       !reader.read(&id.dev) ||
+       !reader.read(&id.ino) ||
+       !reader.read(&id.mtime_ns) ||
+       !reader.read(&id.size) ||
+       !reader.read_blob(&build_id) ||
+       !reader.read_blob(&path) ||
+       !reader.read(&ret->instance_version) ||
+       !reader.read(&ext_count))
+   {
+      return nullptr;
+   }
+   if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+      return nullptr;
+   if (std::string(path.begin(), path.end()) != lib_path)
+      return nullptr; // Hash collision.
+   if (id != cur_id)
+      return nullptr;
+   if (build_id != read_build_id(lib_path))
+      return nullptr;
+
+   // Before resizing, so that a corrupt count can't ask for gigabytes.
+   if (ext_count > reader.remaining() / sizeof(VkExtensionProperties))
+      return nullptr;
+   ret->instance_exts.resize(ext_count);
+   if (!reader.read(ret->instance_exts.data(), ext_count * sizeof(VkExtensionProperties)))
+      return nullptr;
+   return ret;
+}
+
+void
+caps_cache_store(const std::string& lib_path, const IcdCaps& caps)
+{
+   FileId id;
+   if (!FileId::from(lib_path, &id))
+      return;
+
+   const auto dir = cache_dir();
+   if (!dir.size())
+      return;
+
+   const auto build_id = read_build_id(lib_path);
+
+   ByteWriter writer;
+   writer.write(MAGIC, sizeof(MAGIC));
+   writer.write(id.dev);
+   writer.write(id.ino);
+   writer.write(id.mtime_ns);
+   writer.write(id.size);
+   writer.write_blob(build_id.data(), build_id.size());
+   writer.write_blob(lib_path.data(), lib_path.size());
+   writer.write(caps.instance_version);
+   writer.write(uint32_t(caps.instance_exts.size()));
+   writer.write(caps.instance_exts.data(),
+                caps.instance_exts.size() * sizeof(VkExtensionProperties));
+
+   write_entry(entry_path(dir, lib_path), writer.bytes);
+}
+
+// -
+// Failure entry format:
+//    "VKTLFAL1"
+//    u64 dev, ino, mtime_ns, size
+//    u32 path_len, char[path_len]
+//    u32 reason_len, char[reason_len]
+
+static const char FAIL_MAGIC[8] = {'V','K','T','L','F','A','L','1'};
+
+struct Failure final
+{
+   FileId id;
+   bool failed = true;
+   std::string reason;
+};
+
+// Both ways, so that only the first lookup per file (per FileId) reads the cache
+// dir: Misses are the common case, for every good manifest and library.
+// Never destroyed, since apps can still call in from atexit handlers.
+static std::mutex& s_failures_mutex = *new std::mutex;
+static std::unordered_map<std::string, Failure>& s_failures =
+   *new std::unordered_map<std::string, Failure>;
+
+static bool
+fail_cache_load(const std::string& path, Failure* const out)
+{
+   if (!caps_cache_enabled())
+      return false;
+   const auto dir = cache_dir();
+   if (!dir.size())
+      return false;
+
+   const auto bytes = read_entry(entry_path(dir, path, "fail"));
+   if (!bytes)
+      return false;
+
+   ByteReader reader(*bytes);
+   char magic[sizeof(FAIL_MAGIC)];
+   std::vector<char> stored_path;
+   std::vector<char> reason;
+   if (!reader.read(magic, sizeof(magic)) ||
+       !reader.read(&out->id.dev) ||
+       !reader.read(&out->id.ino) ||
+       !reader.read(&out->id.mtime_ns) ||
+       !reader.read(&out->id.size) ||
+       !reader.read_blob(&stored_path) ||
+       !reader.read_blob(&reason))
+   {
+      return false;
+   }
+   if (memcmp(magic, FAIL_MAGIC, sizeof(FAIL_MAGIC)) != 0)
+      return false;
+   if (std::string(stored_path.begin(), stored_path.end()) != path)
+      return false; // Hash collision.
+   out->reason.assign(reason.begin(), reason.end());
+   return true;
+}
+
+bool
+fail_cache_find(const std::string& path, std::string* const out_reason)
+{
+   FileId cur_id;
+   if (!FileId::from(path, &cur_id))
+      return false;
+
+   {
+      const std::lock_guard<std::mutex> lock(s_failures_mutex);
+      const auto itr = s_failures.find(path);
+      if (itr != s_failures.end()) {
+         if (itr->second.id == cur_id) {
+            if (!itr->second.failed)
+               return false;
+            *out_reason = itr->second.reason;
+            return true;
+         }
+         s_failures.erase(itr);
+      }
+   }
+
+   Failure failure;
+   if (!fail_cache_load(path, &failure) || failure.id != cur_id) {
+      failure = {};
+      failure.id = cur_id;
+      failure.failed = false;
+   }
+   const bool failed = failure.failed;
+   if (failed) {
+      *out_reason = failure.reason;
+   }
+
+   const std::lock_guard<std::mutex> lock(s_failures_mutex);
+   s_failures[path] = std::move(failure);
+   return failed;
+}
+
+void
+fail_cache_store(const std::string& path, const std::string& reason, const bool persist)
+{
+   Failure failure;
+   if (!FileId::from(path, &failure.id))
+      return;
+   failure.reason = reason;
+
+   if (persist && caps_cache_enabled()) {
+      const auto dir = cache_dir();
+      if (dir.size()) {
+         ByteWriter writer;
+         writer.write(FAIL_MAGIC, sizeof(FAIL_MAGIC));
+         writer.write(failure.id.dev);
+         writer.write(failure.id.ino);
+         writer.write(failure.id.mtime_ns);
+         writer.write(failure.id.size);
+         writer.write_blob(path.data(), path.size());
+         writer.write_blob(reason.data(), reason.size());
+         write_entry(entry_path(dir, path, "fail"), writer.bytes);
+      }
+   }
+
+   const std::lock_guard<std::mutex> lock(s_failures_mutex);
+   s_failures[path] = std::move(failure);
+}
+
+// -
+
+#ifdef __linux__
+
+template<typename Ehdr, typename Phdr, typename Nhdr>
+static std::vector<uint8_t>
+read_elf_build_id(std::ifstream& in)
+{
+   Ehdr ehdr;
+   in.seekg(0);
+   if (!in.read((char*)&ehdr, sizeof(ehdr)))
+      return {};
+   if (ehdr.e_phentsize != sizeof(Phdr))
+      return {};
+
+   for (uint32_t i = 0; i < ehdr.e_phnum; i++) {
+      Phdr phdr;
+      in.seekg(ehdr.e_phoff + i * sizeof(Phdr));
+      if (!in.read((char*)&phdr, sizeof(phdr)))
+         return {};
+      if (phdr.p_type != PT_NOTE)
+         continue;
+      if (phdr.p_filesz > 64 * 1024)
+         continue;
+
+      std::vector<uint8_t> notes(phdr.p_filesz);
+      in.seekg(phdr.p_offset);
+      if (!in.read((char*)notes.data(), notes.size()))
+         return {};
+
+      const auto align4 = [](const size_t x) { return (x + 3) & ~size_t(3); };
+      size_t pos = 0;
+      while (pos + sizeof(Nhdr) <= notes.size()) {
+         Nhdr nhdr;
+         memcpy(&nhdr, notes.data() + pos, sizeof(nhdr));
+         const auto name_pos = pos + sizeof(Nhdr);
+         const auto desc_pos = name_pos + align4(nhdr.n_namesz);
+         const auto next_pos = desc_pos + align4(nhdr.n_descsz);
+         if (next_pos > notes.size())
+            break;
+
+         if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+             memcmp(notes.data() + name_pos, "GNU", 4) == 0)
+         {
+            const auto desc = notes.data() + desc_pos;
+            return std::vector<uint8_t>(desc, desc + nhdr.n_descsz);
+         }
+         pos = next_pos;
+      }
+   }
+   return {};
+}
+
+std::vector<uint8_t>
+read_build_id(const std::string& lib_path)
+{
+   std::ifstream in(lib_path, std::ios_base::binary);
+   unsigned char ident[EI_NIDENT];
+   if (!in.read((char*)ident, sizeof(ident)))
+      return {};
+   if (memcmp(ident, ELFMAG, SELFMAG) != 0)
+      return {};
+
+   if (ident[EI_CLASS] == ELFCLASS64)
+      return read_elf_build_id<Elf64_Ehdr, Elf64_Phdr, Elf64_Nhdr>(in);
+   if (ident[EI_CLASS] == ELFCLASS32)
+      return read_elf_build_id<Elf32_Ehdr, Elf32_Phdr, Elf32_Nhdr>(in);
+   return {};
+}
+
+#else
+
+std::vector<uint8_t>
+read_build_id(const std::string&)
+{
+   return {}; // FileId alone has to do.
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef ICD_CAPS_CACHE_H
+#define ICD_CAPS_CACHE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "vulkan/vulkan.h"
+
+// Per-user on-disk cache of each ICD's global (instance-less) query results, so
+// vkEnumerateInstanceExtensionProperties/vkEnumerateInstanceVersion don't need to
+// dlopen every driver in every process.
+//
+// Entries are keyed by the library's FileId and (where available) its build id.
+// If either changes, the entry is stale and gets repopulated.
+//
+// The cache dir gets the same budget as each ICD dir (see find_icds.h): If its
+// first read hangs, e.g. on a dead NFS $HOME, there's no cache for the rest of the
+// process, rather than a stall on every lookup.
+//
+// Set VK_TINY_LOADER_CAPS_CACHE=0 to disable.
+
+struct IcdCaps final
+{
+   uint32_t instance_version = VK_API_VERSION_1_0;
+   std::vector<VkExtensionProperties> instance_exts;
+};
+
+bool caps_cache_enabled();
+
+// Null on miss, including when the library changed since it was stored.
+std::unique_ptr<IcdCaps> caps_cache_load(const std::string& lib_path);
+
+// Best-effort: Failures to write are ignored.
+void caps_cache_store(const std::string& lib_path, const IcdCaps& caps);
+
+// Empty if unavailable. (GNU build-id note on ELF platforms)
+std::vector<uint8_t> read_build_id(const std::string& lib_path);
+
+// -
+// Negative cache: ICD manifests and libraries that failed, and why, so that they're
+// skipped until the file itself changes (by FileId).
+// Failures, and misses, are always remembered for the rest of the process, so the
+// cache dir is only read once per file (until it changes). Only `persist` ones
+// go on disk (unless disabled as above), since e.g. a dlopen failure can also be
+// fixed by installing a missing dependency.
+
+// False if `path` isn't known to be bad, or has changed since.
+bool fail_cache_find(const std::string& path, std::string* out_reason);
+
+// Ignored if `path` can't be stat'd.
+void fail_cache_store(const std::string& path, const std::string& reason, bool persist);
+
+#endif // ICD_CAPS_CACHE_H
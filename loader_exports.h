@@ -0,0 +1,48 @@
+#ifndef LOADER_EXPORTS_H
+#define LOADER_EXPORTS_H
+
+// Include before vulkan/vulkan.h, so that the prototypes match.
+
+// The C entrypoints stay visible under -fvisibility=hidden, except in the static
+// library build (see build.sh), where they're just as hidden as everything else:
+// They're linked straight into the app, and LTO can then inline them into their
+// call sites.
+#if defined(VKTL_STATIC) || !defined(__GNUC__)
+#define VKTL_EXPORT
+#else
+#define VKTL_EXPORT __attribute__((visibility("default")))
+#endif
+
+// -DVKTL_PREFIX=myapp_ renames our vk* entrypoints to myapp_vk*, e.g. so that a
+// statically linked loader can sit alongside a system libvulkan. Apps calling them
+// by name need the same define when including vk_tiny_loader.h. The names handed
+// out by vkGetInstanceProcAddr are unaffected.
+#ifdef VKTL_PREFIX
+
+#define VKTL_CAT_(a, b) a##b
+#define VKTL_CAT(a, b) VKTL_CAT_(a, b)
+#define VKTL_PREFIXED(x) VKTL_CAT(VKTL_PREFIX, x)
+
+#define vkCreateInstance VKTL_PREFIXED(vkCreateInstance)
+#define vkEnumerateInstanceExtensionProperties VKTL_PREFIXED(vkEnumerateInstanceExtensionProperties)
+#define vkEnumerateInstanceLayerProperties VKTL_PREFIXED(vkEnumerateInstanceLayerProperties)
+#define vkEnumerateInstanceVersion VKTL_PREFIXED(vkEnumerateInstanceVersion)
+#define vkGetInstanceProcAddr VKTL_PREFIXED(vkGetInstanceProcAddr)
+
+#define vkDestroyInstance VKTL_PREFIXED(vkDestroyInstance)
+#define vkEnumeratePhysicalDevices VKTL_PREFIXED(vkEnumeratePhysicalDevices)
+#define vkGetPhysicalDeviceFeatures VKTL_PREFIXED(vkGetPhysicalDeviceFeatures)
+#define vkGetPhysicalDeviceFormatProperties VKTL_PREFIXED(vkGetPhysicalDeviceFormatProperties)
+#define vkGetPhysicalDeviceImageFormatProperties VKTL_PREFIXED(vkGetPhysicalDeviceImageFormatProperties)
+#define vkGetPhysicalDeviceProperties VKTL_PREFIXED(vkGetPhysicalDeviceProperties)
+#define vkGetPhysicalDeviceQueueFamilyProperties VKTL_PREFIXED(vkGetPhysicalDeviceQueueFamilyProperties)
+#define vkGetPhysicalDeviceMemoryProperties VKTL_PREFIXED(vkGetPhysicalDeviceMemoryProperties)
+#define vkCreateDevice VKTL_PREFIXED(vkCreateDevice)
+#define vkEnumerateDeviceExtensionProperties VKTL_PREFIXED(vkEnumerateDeviceExtensionProperties)
+#define vkEnumerateDeviceLayerProperties VKTL_PREFIXED(vkEnumerateDeviceLayerProperties)
+#define vkGetDeviceProcAddr VKTL_PREFIXED(vkGetDeviceProcAddr)
+#define vkDestroyDevice VKTL_PREFIXED(vkDestroyDevice)
+
+#endif // VKTL_PREFIX
+
+#endif // LOADER_EXPORTS_H
@@ -0,0 +1,204 @@
+#include "sealed_config.h"
+
+#include <cstdio>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// -
+// Format: (native endian, like the caps cache)
+//    "VKTLCFG1"
+//    u64 fnv1a64 of everything after this field
+//    u32 icd_count
+//    Per ICD:
+//       u32 len, char[len] json_path, library_path, vk_api_version
+//       u64 json dev, ino, mtime_ns, size
+//       u64 lib dev, ino, mtime_ns, size
+//       u8 has_caps
+//       If has_caps:
+//          u32 instance_version
+//          u32 len, VkExtensionProperties[len / sizeof(VkExtensionProperties)]
+
+static const char MAGIC[8] = {'V','K','T','L','C','F','G','1'};
+
+std::string
+sealed_config_path()
+{
+   const auto env = getenv("VK_TINY_LOADER_CONFIG");
+   if (env)
+      return env;
+#ifdef _WIN32
+   return "";
+#else
+   return "/etc/vk_tiny_loader/sealed.cfg";
+#endif
+}
+
+// -
+
+static void
+write_file_id(ByteWriter* const writer, const FileId& id)
+{
+   writer->write(id.dev);
+   writer->write(id.ino);
+   writer->write(id.mtime_ns);
+   writer->write(id.size);
+}
+
+static bool
+read_file_id(ByteReader* const reader, FileId* const out)
+{
+   return reader->read(&out->dev) &&
+          reader->read(&out->ino) &&
+          reader->read(&out->mtime_ns) &&
+          reader->read(&out->size);
+}
+
+static bool
+read_string(ByteReader* const reader, std::string* const out)
+{
+   std::vector<char> chars;
+   if (!reader->read_blob(&chars))
+      return false;
+   out->assign(chars.begin(), chars.end());
+   return true;
+}
+
+bool
+sealed_config_write(const std::string& path, const std::vector<SealedIcd>& icds,
+                    std::string* const out_err)
+{
+   ByteWriter payload;
+   payload.write(uint32_t(icds.size()));
+   for (const auto& icd : icds) {
+      const auto& info = icd.info;
+      payload.write_blob(info.json_path.data(), info.json_path.size());
+      payload.write_blob(info.library_path.data(), info.library_path.size());
+      payload.write_blob(info.vk_api_version.data(), info.vk_api_version.size());
+      write_file_id(&payload, icd.json_id);
+      write_file_id(&payload, icd.lib_id);
+      payload.write(uint8_t(bool(icd.caps)));
+      if (icd.caps) {
+         const auto& exts = icd.caps->instance_exts;
+         payload.write(icd.caps->instance_version);
+         payload.write_blob(exts.data(), exts.size() * sizeof(exts[0]));
+      }
+   }
+
+   ByteWriter writer;
+   writer.write(MAGIC, sizeof(MAGIC));
+   writer.write(fnv1a64(payload.bytes.data(), payload.bytes.size()));
+   writer.write(payload.bytes.data(), payload.bytes.size());
+
+   std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+   out.write((const char*)writer.bytes.data(), writer.bytes.size());
+   if (!out.good()) {
+      *out_err = "Failed to write " + path + ".";
+      return false;
+   }
+   return true;
+}
+
+// -
+
+static std::unique_ptr<std::vector<SealedIcd>>
+parse(const uint8_t* const data, const size_t size, std::string* const out_err)
+{
+   ByteReader reader(data, size);
+   char magic[sizeof(MAGIC)];
+   uint64_t hash;
+   if (!reader.read(magic, sizeof(magic)) ||
+       memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+       !reader.read(&hash))
+   {
+      *out_err = "Not a sealed config.";
+      return nullptr;
+   }
+   const auto payload_size = reader.remaining();
+   if (fnv1a64(data + (size - payload_size), payload_size) != hash) {
+      *out_err = "Corrupt.";
+      return nullptr;
+   }
+
+   uint32_t count;
+   if (!reader.read(&count)) {
+      *out_err = "Truncated.";
+      return nullptr;
+   }
+   auto ret = std::make_unique<std::vector<SealedIcd>>();
+   for (uint32_t i = 0; i < count; i++) {
+      SealedIcd icd;
+      uint8_t has_caps;
+      if (!read_string(&reader, &icd.info.json_path) ||
+          !read_string(&reader, &icd.info.library_path) ||
+          !read_string(&reader, &icd.info.vk_api_version) ||
+          !read_file_id(&reader, &icd.json_id) ||
+          !read_file_id(&reader, &icd.lib_id) ||
+          !reader.read(&has_caps))
+      {
+         *out_err = "Truncated.";
+         return nullptr;
+      }
+      if (has_caps) {
+         icd.caps = std::make_unique<IcdCaps>();
+         if (!reader.read(&icd.caps->instance_version) ||
+             !reader.read_blob(&icd.caps->instance_exts))
+         {
+            *out_err = "Truncated.";
+            return nullptr;
+         }
+      }
+
+      FileId cur_id;
+      if (!FileId::from(icd.info.json_path, &cur_id) || cur_id != icd.json_id) {
+         *out_err = "Stale: " + icd.info.json_path + " changed.";
+         return nullptr;
+      }
+      if (icd.lib_id != FileId()) {
+         if (!FileId::from(icd.info.library_path, &cur_id) || cur_id != icd.lib_id) {
+            *out_err = "Stale: " + icd.info.library_path + " changed.";
+            return nullptr;
+         }
+      }
+      ret->push_back(std::move(icd));
+   }
+   return ret;
+}
+
+std::unique_ptr<std::vector<SealedIcd>>
+sealed_config_load(const std::string& path, std::string* const out_err)
+{
+#ifdef _WIN32
+   const auto bytes = read_bytes(path, out_err, std::ios_base::binary);
+   if (!bytes)
+      return nullptr;
+   return parse(bytes->data(), bytes->size(), out_err);
+#else
+   const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd == -1) {
+      *out_err = "Failed to open " + path + ".";
+      return nullptr;
+   }
+   struct stat st;
+   if (fstat(fd, &st) != 0 || !st.st_size) {
+      close(fd);
+      *out_err = "Empty.";
+      return nullptr;
+   }
+   const auto size = size_t(st.st_size);
+   const auto map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      *out_err = "Failed to map " + path + ".";
+      return nullptr;
+   }
+   auto ret = parse((const uint8_t*)map, size, out_err);
+   munmap(map, size);
+   return ret;
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef SEALED_CONFIG_H
+#define SEALED_CONFIG_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "find_icds.h"
+#include "icd_caps_cache.h"
+#include "utils.h"
+
+// A precomputed driver list, for hosts whose drivers never change (e.g. containers
+// with read-only root filesystems). `dump_icds --emit-config <path>` writes one,
+// and the loader then skips enum_icd_paths(), list_dir, and JSON parsing.
+//
+// The config is rejected as a whole if it's corrupt, or if any manifest or library
+// it lists no longer matches its recorded FileId, and discovery runs as usual.
+// Manifests added after sealing aren't noticed, so re-emit when drivers change.
+
+struct SealedIcd final
+{
+   IcdInfo info;
+   FileId json_id;
+   FileId lib_id; // Zero for bare library names, which aren't checked.
+   std::unique_ptr<IcdCaps> caps; // Optional.
+};
+
+/* VK_TINY_LOADER_CONFIG, if set. (empty disables)
+ * Otherwise /etc/vk_tiny_loader/sealed.cfg, except on Windows.
+ */
+std::string sealed_config_path();
+
+std::unique_ptr<std::vector<SealedIcd>> sealed_config_load(const std::string& path,
+                                                           std::string* out_err);
+
+bool sealed_config_write(const std::string& path, const std::vector<SealedIcd>& icds,
+                         std::string* out_err);
+
+#endif // SEALED_CONFIG_H
@@ -0,0 +1,311 @@
+#include "tramp_pool.h"
+
+#include "api_trace.h"
+
+// Each trampoline is padded to a fixed 16-byte stride, so slot n lives at
+// base + 16*n and no per-slot symbols are needed.
+//
+// Traced trampolines put their slot in a scratch register and share a stub that
+// saves every arg register, records the call (see api_trace.h), restores them, and
+// then does what the untraced trampoline does.
+
+#if defined(__GNUC__) && !defined(_WIN32) && (defined(__x86_64__) || defined(__aarch64__))
+#define TRAMP_POOL_ASM 1
+#endif
+
+#ifdef TRAMP_POOL_ASM
+
+#ifdef __APPLE__
+#define TRAMP_SYM(name) "_" #name
+#define TRAMP_DECL(name) ".private_extern " TRAMP_SYM(name) "\n"
+#else
+#define TRAMP_SYM(name) #name
+#define TRAMP_DECL(name) ".hidden " TRAMP_SYM(name) "\n" \
+                         ".type " TRAMP_SYM(name) ", @function\n"
+#endif
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+#ifdef __x86_64__
+
+// rdi: First arg.
+asm(
+   ".text\n"
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_phys_dev_tramps) "\n"
+   TRAMP_DECL(vktl_phys_dev_tramps)
+   TRAMP_SYM(vktl_phys_dev_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(PHYS_DEV_TRAMP_COUNT_LIT) "\n"
+   "   movq (%rdi), %rax\n"              // slots
+   "   movq 8(%rdi), %rdi\n"             // ICD handle
+   "   jmpq *(8 * vktl_i)(%rax)\n"
+   "   .p2align 4, 0xcc\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_device_tramps) "\n"
+   TRAMP_DECL(vktl_device_tramps)
+   TRAMP_SYM(vktl_device_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(DEVICE_TRAMP_COUNT_LIT) "\n"
+   "   movq (%rdi), %rax\n"              // slots
+   "   jmpq *(8 * vktl_i)(%rax)\n"
+   "   .p2align 4, 0xcc\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+);
+
+// r11: Slot. On entry, rsp is 8 off 16-byte alignment, so after seven pushes and
+// the xmm spill, it's aligned for the call.
+#define TRACED_SAVE \
+   "   pushq %rdi\n" \
+   "   pushq %rsi\n" \
+   "   pushq %rdx\n" \
+   "   pushq %rcx\n" \
+   "   pushq %r8\n" \
+   "   pushq %r9\n" \
+   "   pushq %r11\n" \
+   "   subq $128, %rsp\n" \
+   "   movaps %xmm0, 0(%rsp)\n" \
+   "   movaps %xmm1, 16(%rsp)\n" \
+   "   movaps %xmm2, 32(%rsp)\n" \
+   "   movaps %xmm3, 48(%rsp)\n" \
+   "   movaps %xmm4, 64(%rsp)\n" \
+   "   movaps %xmm5, 80(%rsp)\n" \
+   "   movaps %xmm6, 96(%rsp)\n" \
+   "   movaps %xmm7, 112(%rsp)\n" \
+   "   movq %rdi, %rsi\n"               /* handle */ \
+   "   movl %r11d, %edi\n"              /* slot */
+
+#define TRACED_RESTORE \
+   "   movaps 0(%rsp), %xmm0\n" \
+   "   movaps 16(%rsp), %xmm1\n" \
+   "   movaps 32(%rsp), %xmm2\n" \
+   "   movaps 48(%rsp), %xmm3\n" \
+   "   movaps 64(%rsp), %xmm4\n" \
+   "   movaps 80(%rsp), %xmm5\n" \
+   "   movaps 96(%rsp), %xmm6\n" \
+   "   movaps 112(%rsp), %xmm7\n" \
+   "   addq $128, %rsp\n" \
+   "   popq %r11\n" \
+   "   popq %r9\n" \
+   "   popq %r8\n" \
+   "   popq %rcx\n" \
+   "   popq %rdx\n" \
+   "   popq %rsi\n" \
+   "   popq %rdi\n"
+
+asm(
+   ".text\n"
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_traced_phys_dev_tramps) "\n"
+   TRAMP_DECL(vktl_traced_phys_dev_tramps)
+   TRAMP_SYM(vktl_traced_phys_dev_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(PHYS_DEV_TRAMP_COUNT_LIT) "\n"
+   "   movl $vktl_i, %r11d\n"
+   "   jmp vktl_traced_phys_dev_stub\n"
+   "   .p2align 4, 0xcc\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+   "vktl_traced_phys_dev_stub:\n"
+   TRACED_SAVE
+   "   call " TRAMP_SYM(vktl_trace_phys_dev_tramp) "\n"
+   TRACED_RESTORE
+   "   movq (%rdi), %rax\n"              // slots
+   "   movq 8(%rdi), %rdi\n"             // ICD handle
+   "   jmpq *(%rax, %r11, 8)\n"
+
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_traced_device_tramps) "\n"
+   TRAMP_DECL(vktl_traced_device_tramps)
+   TRAMP_SYM(vktl_traced_device_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(DEVICE_TRAMP_COUNT_LIT) "\n"
+   "   movl $vktl_i, %r11d\n"
+   "   jmp vktl_traced_device_stub\n"
+   "   .p2align 4, 0xcc\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+   "vktl_traced_device_stub:\n"
+   TRACED_SAVE
+   "   call " TRAMP_SYM(vktl_trace_device_tramp) "\n"
+   TRACED_RESTORE
+   "   movq (%rdi), %rax\n"              // slots
+   "   jmpq *(%rax, %r11, 8)\n"
+);
+
+#else // __aarch64__
+
+// x0: First arg. x16: Intra-procedure-call scratch.
+asm(
+   ".text\n"
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_phys_dev_tramps) "\n"
+   TRAMP_DECL(vktl_phys_dev_tramps)
+   TRAMP_SYM(vktl_phys_dev_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(PHYS_DEV_TRAMP_COUNT_LIT) "\n"
+   "   ldr x16, [x0]\n"                  // slots
+   "   ldr x0, [x0, #8]\n"               // ICD handle
+   "   ldr x16, [x16, #(8 * vktl_i)]\n"
+   "   br x16\n"
+   "   .p2align 4\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_device_tramps) "\n"
+   TRAMP_DECL(vktl_device_tramps)
+   TRAMP_SYM(vktl_device_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(DEVICE_TRAMP_COUNT_LIT) "\n"
+   "   ldr x16, [x0]\n"                  // slots
+   "   ldr x16, [x16, #(8 * vktl_i)]\n"
+   "   br x16\n"
+   "   .p2align 4\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+);
+
+// x17: Slot. Saves x0-x8 (x8: indirect result), x17, and q0-q7, under a frame
+// record.
+#define TRACED_SAVE \
+   "   stp x29, x30, [sp, #-224]!\n" \
+   "   mov x29, sp\n" \
+   "   stp x0, x1, [sp, #16]\n" \
+   "   stp x2, x3, [sp, #32]\n" \
+   "   stp x4, x5, [sp, #48]\n" \
+   "   stp x6, x7, [sp, #64]\n" \
+   "   stp x8, x17, [sp, #80]\n" \
+   "   stp q0, q1, [sp, #96]\n" \
+   "   stp q2, q3, [sp, #128]\n" \
+   "   stp q4, q5, [sp, #160]\n" \
+   "   stp q6, q7, [sp, #192]\n" \
+   "   mov x1, x0\n"                    /* handle */ \
+   "   mov w0, w17\n"                   /* slot */
+
+#define TRACED_RESTORE \
+   "   ldp q6, q7, [sp, #192]\n" \
+   "   ldp q4, q5, [sp, #160]\n" \
+   "   ldp q2, q3, [sp, #128]\n" \
+   "   ldp q0, q1, [sp, #96]\n" \
+   "   ldp x8, x17, [sp, #80]\n" \
+   "   ldp x6, x7, [sp, #64]\n" \
+   "   ldp x4, x5, [sp, #48]\n" \
+   "   ldp x2, x3, [sp, #32]\n" \
+   "   ldp x0, x1, [sp, #16]\n" \
+   "   ldp x29, x30, [sp], #224\n"
+
+asm(
+   ".text\n"
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_traced_phys_dev_tramps) "\n"
+   TRAMP_DECL(vktl_traced_phys_dev_tramps)
+   TRAMP_SYM(vktl_traced_phys_dev_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(PHYS_DEV_TRAMP_COUNT_LIT) "\n"
+   "   mov w17, #vktl_i\n"
+   "   b vktl_traced_phys_dev_stub\n"
+   "   .p2align 4\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+   "vktl_traced_phys_dev_stub:\n"
+   TRACED_SAVE
+   "   bl " TRAMP_SYM(vktl_trace_phys_dev_tramp) "\n"
+   TRACED_RESTORE
+   "   ldr x16, [x0]\n"                  // slots
+   "   ldr x0, [x0, #8]\n"               // ICD handle
+   "   ldr x16, [x16, x17, lsl #3]\n"
+   "   br x16\n"
+
+   ".p2align 4\n"
+   ".globl " TRAMP_SYM(vktl_traced_device_tramps) "\n"
+   TRAMP_DECL(vktl_traced_device_tramps)
+   TRAMP_SYM(vktl_traced_device_tramps) ":\n"
+   ".set vktl_i, 0\n"
+   ".rept " STR(DEVICE_TRAMP_COUNT_LIT) "\n"
+   "   mov w17, #vktl_i\n"
+   "   b vktl_traced_device_stub\n"
+   "   .p2align 4\n"
+   "   .set vktl_i, vktl_i + 1\n"
+   ".endr\n"
+   "vktl_traced_device_stub:\n"
+   TRACED_SAVE
+   "   bl " TRAMP_SYM(vktl_trace_device_tramp) "\n"
+   TRACED_RESTORE
+   "   ldr x16, [x0]\n"                  // slots
+   "   ldr x16, [x16, x17, lsl #3]\n"
+   "   br x16\n"
+);
+
+#endif
+
+extern "C" void vktl_phys_dev_tramps();
+extern "C" void vktl_device_tramps();
+extern "C" void vktl_traced_phys_dev_tramps();
+extern "C" void vktl_traced_device_tramps();
+
+// Called from the asm above, so LTO mustn't drop or rename them.
+extern "C" __attribute__((visibility("hidden"), used)) void
+vktl_trace_phys_dev_tramp(const uint32_t slot, const void* const handle)
+{
+   uint64_t seq;
+   (void)ApiTrace::Begin(TRACE_PHYS_DEV_TRAMP_BASE + slot, handle, TRACE_JUMPED, &seq);
+}
+
+extern "C" __attribute__((visibility("hidden"), used)) void
+vktl_trace_device_tramp(const uint32_t slot, const void* const handle)
+{
+   uint64_t seq;
+   (void)ApiTrace::Begin(TRACE_DEVICE_TRAMP_BASE + slot, handle, TRACE_JUMPED, &seq);
+}
+
+#endif // TRAMP_POOL_ASM
+
+// -
+
+bool
+tramp_pool_supported()
+{
+#ifdef TRAMP_POOL_ASM
+   return true;
+#else
+   return false;
+#endif
+}
+
+PFN_vkVoidFunction
+phys_dev_tramp(const uint32_t slot, const bool traced)
+{
+#ifdef TRAMP_POOL_ASM
+   if (slot >= PHYS_DEV_TRAMP_COUNT)
+      return nullptr;
+   const auto base = traced ? (uintptr_t)&vktl_traced_phys_dev_tramps
+                            : (uintptr_t)&vktl_phys_dev_tramps;
+   return (PFN_vkVoidFunction)(base + 16 * slot);
+#else
+   (void)slot;
+   (void)traced;
+   return nullptr;
+#endif
+}
+
+PFN_vkVoidFunction
+device_tramp(const uint32_t slot, const bool traced)
+{
+#ifdef TRAMP_POOL_ASM
+   if (slot >= DEVICE_TRAMP_COUNT)
+      return nullptr;
+   const auto base = traced ? (uintptr_t)&vktl_traced_device_tramps
+                            : (uintptr_t)&vktl_device_tramps;
+   return (PFN_vkVoidFunction)(base + 16 * slot);
+#else
+   (void)slot;
+   (void)traced;
+   return nullptr;
+#endif
+}
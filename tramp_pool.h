@@ -0,0 +1,44 @@
+#ifndef TRAMP_POOL_H
+#define TRAMP_POOL_H
+
+#include <cstdint>
+
+#include "api_subset.h"
+#include "vulkan/vulkan.h"
+
+// Pre-built pools of indexed trampolines for functions the loader doesn't know at
+// compile time. Each unknown name gets a slot once, each driver resolves it once
+// into a flat array, and calls then cost one or two loads and an indirect jump.
+//
+// Layout contracts with the trampolines:
+//  * A VkPhysicalDevice handed to the app points at a record whose first word is
+//    a `const PFN_vkVoidFunction*` (the owning ICD's resolved slots), and whose
+//    second word is the ICD's own VkPhysicalDevice. The trampoline swaps in the
+//    ICD handle as the first arg, then jumps to slots[n]. Instance-level commands
+//    use these too, with a VkInstance laid out the same way.
+//  * The loader-data word of an ICD's VkDevice points at a flat
+//    `PFN_vkVoidFunction[DEVICE_TRAMP_COUNT]`. Device handles aren't wrapped, so
+//    the trampoline just jumps to slots[n].
+
+// Literals (or literal expressions), for `.rept`.
+#ifdef VKTL_ALLOWED
+// Any allowed command could turn out to be either kind.
+#define PHYS_DEV_TRAMP_COUNT_LIT VKTL_ALLOWED_FN_COUNT
+#define DEVICE_TRAMP_COUNT_LIT VKTL_ALLOWED_FN_COUNT
+#else
+#define PHYS_DEV_TRAMP_COUNT_LIT 256
+#define DEVICE_TRAMP_COUNT_LIT 1024
+#endif
+
+constexpr uint32_t PHYS_DEV_TRAMP_COUNT = PHYS_DEV_TRAMP_COUNT_LIT;
+constexpr uint32_t DEVICE_TRAMP_COUNT = DEVICE_TRAMP_COUNT_LIT;
+
+// False on targets without hand-written trampolines. Unknown functions are then
+// just not available via vkGetInstanceProcAddr.
+bool tramp_pool_supported();
+
+// Traced trampolines record each call first. (see api_trace.h)
+PFN_vkVoidFunction phys_dev_tramp(uint32_t slot, bool traced = false);
+PFN_vkVoidFunction device_tramp(uint32_t slot, bool traced = false);
+
+#endif // TRAMP_POOL_H
@@ -1,8 +1,15 @@
 #include "utils.h"
 
 #include <codecvt>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cwctype>
 #include <fstream>
 #include <locale>
+#include <system_error>
+#include <thread>
+#include <sys/stat.h>
 
 size_t
 next_pot(const size_t x)
@@ -14,6 +21,30 @@ next_pot(const size_t x)
    return (~v) & (v << 1);
 }
 
+bool
+is_debug_log_enabled()
+{
+   static const bool ret = []() {
+      const auto env = getenv("VK_TINY_LOADER_DEBUG");
+      return env && *env && std::string(env) != "0";
+   }();
+   return ret;
+}
+
+void
+debug_log(const char* const format, ...)
+{
+   if (!is_debug_log_enabled())
+      return;
+
+   va_list args;
+   va_start(args, format);
+   fprintf(stderr, "vk_tiny_loader: ");
+   vfprintf(stderr, format, args);
+   fprintf(stderr, "\n");
+   va_end(args);
+}
+
 std::unique_ptr<std::vector<uint8_t>>
 read_bytes(std::istream* const in, std::string* const out_err)
 {
@@ -70,6 +101,38 @@ ends_with(const std::string& str, const std::string& needle)
    return pos == str.size() - needle.size();
 }
 
+bool
+glob_match(const std::string& pattern, const std::string& str)
+{
+   size_t p = 0;
+   size_t s = 0;
+   auto star_p = std::string::npos;
+   size_t star_s = 0;
+   while (s < str.size()) {
+      if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == str[s])) {
+         p++;
+         s++;
+         continue;
+      }
+      if (p < pattern.size() && pattern[p] == '*') {
+         star_p = p;
+         star_s = s;
+         p++;
+         continue;
+      }
+      if (star_p == std::string::npos)
+         return false;
+      // Backtrack: Let the last '*' eat one more char.
+      p = star_p + 1;
+      star_s++;
+      s = star_s;
+   }
+   while (p < pattern.size() && pattern[p] == '*') {
+      p++;
+   }
+   return p == pattern.size();
+}
+
 // -
 
 static const char PATH_SEP =
@@ -89,8 +152,119 @@ path_parent(const std::string& path)
    return path.substr(0, sep);
 }
 
+std::string
+path_filename(const std::string& path)
+{
+   const auto sep = path.find_last_of(PATH_SEP);
+   if (sep == std::string::npos)
+      return path;
+
+   return path.substr(sep + 1);
+}
+
 std::string
 path_concat(const std::string& a, const std::string& b)
 {
    return a + PATH_SEP + b;
 }
+
+// -
+
+/*static*/ bool
+FileId::from(const std::string& path, FileId* const out)
+{
+#ifdef _WIN32
+   struct _stat64 st;
+   if (_wstat64(to_wstring(path).c_str(), &st) != 0)
+      return false;
+   const uint64_t mtime_ns = uint64_t(st.st_mtime) * 1000 * 1000 * 1000;
+#else
+   struct stat st;
+   if (stat(path.c_str(), &st) != 0)
+      return false;
+#ifdef __APPLE__
+   const auto& mtime = st.st_mtimespec;
+#else
+   const auto& mtime = st.st_mtim;
+#endif
+   const uint64_t mtime_ns = uint64_t(mtime.tv_sec) * 1000 * 1000 * 1000 + mtime.tv_nsec;
+#endif
+
+   out->dev = st.st_dev;
+   out->ino = st.st_ino;
+   out->mtime_ns = mtime_ns;
+   out->size = st.st_size;
+   return true;
+}
+
+std::string
+file_identity(const std::string& path)
+{
+#ifdef _WIN32
+   // No inode numbers, so the best we have is the full path, case-folded.
+   const auto full = _wfullpath(nullptr, to_wstring(path).c_str(), 0);
+   if (!full)
+      return path;
+   std::wstring ret = full;
+   free(full);
+   std::transform(ret.begin(), ret.end(), ret.begin(), towlower);
+   return to_string(ret);
+#else
+   FileId id;
+   if (FileId::from(path, &id))
+      return std::to_string(id.dev) + ":" + std::to_string(id.ino);
+
+   // Can't be stat'd, e.g. since removed, so resolve as much of it as still
+   // exists: Symlinks, "..", and such in its dir.
+   const auto fn_realpath = [](const std::string& x, std::string* const out) {
+      const auto real = realpath(x.c_str(), nullptr);
+      if (!real)
+         return false;
+      *out = real;
+      free(real);
+      return true;
+   };
+   std::string ret;
+   if (fn_realpath(path, &ret))
+      return ret;
+   const auto parent = path_parent(path);
+   if (parent.size() && fn_realpath(parent, &ret))
+      return path_concat(ret, path_filename(path));
+   return path;
+#endif
+}
+
+uint64_t
+fnv1a64(const void* const data, const size_t size)
+{
+   const auto bytes = (const uint8_t*)data;
+   uint64_t ret = 0xcbf29ce484222325;
+   for (size_t i = 0; i < size; i++) {
+      ret ^= bytes[i];
+      ret *= 0x100000001b3;
+   }
+   return ret;
+}
+
+void
+fan_out(const size_t n, const std::function<void(size_t)>& fn)
+{
+   std::vector<std::thread> threads;
+   size_t i = 1;
+   for (; i < n; i++) {
+      try {
+         threads.emplace_back(fn, i);
+      } catch (const std::system_error&) {
+         break;
+      }
+   }
+   for (size_t j = i; j < n; j++) {
+      fn(j);
+   }
+   if (n) {
+      fn(0);
+   }
+   for (auto& thread : threads) {
+      thread.join();
+   }
+}
@@ -2,6 +2,9 @@
 #define UTILS_H
 
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <string>
@@ -9,6 +12,14 @@
 
 size_t next_pot(size_t x);
 
+// To stderr, if VK_TINY_LOADER_DEBUG is set.
+bool is_debug_log_enabled();
+void debug_log(const char* format, ...)
+#ifdef __GNUC__
+   __attribute__((format(printf, 1, 2)))
+#endif
+   ;
+
 std::unique_ptr<std::vector<uint8_t>>
 read_bytes(std::istream* in, std::string* out_err);
 
@@ -102,10 +113,123 @@ std::unique_ptr<T> as_unique(T* const p)
 bool
 ends_with(const std::string& str, const std::string& needle);
 
+// Shell-style: '*' matches any run of chars, '?' matches any one char.
+bool
+glob_match(const std::string& pattern, const std::string& str);
+
 std::string
 path_parent(const std::string& path);
 
+std::string
+path_filename(const std::string& path);
+
 std::string
 path_concat(const std::string& a, const std::string& b);
 
+uint64_t
+fnv1a64(const void* data, size_t size);
+
+// Runs fn(0..n-1) concurrently, with fn(0) on the calling thread, and waits for all
+// of them. Falls back to running them in order if threads can't be started.
+void
+fan_out(size_t n, const std::function<void(size_t)>& fn);
+
+inline uint64_t
+fnv1a64(const std::string& str)
+{
+   return fnv1a64(str.data(), str.size());
+}
+
+// -
+// For the loader's own native-endian binary files.
+
+class ByteWriter final
+{
+public:
+   std::vector<uint8_t> bytes;
+
+   void write(const void* const data, const size_t size) {
+      const auto begin = (const uint8_t*)data;
+      bytes.insert(bytes.end(), begin, begin + size);
+   }
+
+   template<typename T>
+   void write(const T& val) {
+      write(&val, sizeof(val));
+   }
+
+   void write_blob(const void* const data, const uint32_t size) {
+      write(size);
+      write(data, size);
+   }
+};
+
+class ByteReader final
+{
+   const uint8_t* pos_;
+   const uint8_t* const end_;
+
+public:
+   ByteReader(const uint8_t* const data, const size_t size)
+      : pos_(data)
+      , end_(data + size)
+   { }
+
+   explicit ByteReader(const std::vector<uint8_t>& bytes)
+      : ByteReader(bytes.data(), bytes.size())
+   { }
+
+   size_t remaining() const { return end_ - pos_; }
+
+   bool read(void* const out, const size_t size) {
+      if (size_t(end_ - pos_) < size)
+         return false;
+      memcpy(out, pos_, size);
+      pos_ += size;
+      return true;
+   }
+
+   template<typename T>
+   bool read(T* const out) {
+      return read(out, sizeof(*out));
+   }
+
+   template<typename T>
+   bool read_blob(std::vector<T>* const out) {
+      uint32_t size;
+      if (!read(&size))
+         return false;
+      if (size % sizeof(T) || size > size_t(end_ - pos_))
+         return false;
+      out->resize(size / sizeof(T));
+      return read(out->data(), size);
+   }
+};
+
+// -
+
+struct FileId final
+{
+   uint64_t dev = 0;
+   uint64_t ino = 0;
+   uint64_t mtime_ns = 0;
+   uint64_t size = 0;
+
+   // False if `path` can't be stat'd, e.g. a bare library name left for dlopen to find.
+   static bool from(const std::string& path, FileId* out);
+
+   bool operator==(const FileId& rhs) const {
+      return dev == rhs.dev && ino == rhs.ino && mtime_ns == rhs.mtime_ns &&
+             size == rhs.size;
+   }
+   bool operator!=(const FileId& rhs) const { return !(*this == rhs); }
+};
+
+// Equal for any two paths to the same file, e.g. via symlinks or hardlinks:
+// "<dev>:<ino>" where there are inodes. Otherwise a normalized path (realpath, or
+// failing that, its dir's), or failing that, `path` itself.
+// Relative paths are relative to the cwd, so this is no good for bare library
+// names, which dlopen searches for instead.
+std::string file_identity(const std::string& path);
+
 #endif // UTILS_H
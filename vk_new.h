@@ -1,6 +1,8 @@
 #ifndef VK_NEW_H
 #define VK_NEW_H
 
+#include <cstddef>
+#include <new>
 #include "utils.h"
 #include "vulkan/vulkan.h"
 
@@ -10,7 +12,7 @@ bool HasInternalCallbacks(const VkAllocationCallbacks* info);
 
 // -
 
-template<T>
+template<typename T>
 static T*
 vk_new(const VkAllocationCallbacks* const info,
        const VkSystemAllocationScope scope = VK_SYSTEM_ALLOCATION_SCOPE_COMMAND)
@@ -19,13 +21,15 @@ vk_new(const VkAllocationCallbacks* const info,
       return new T;
 
    const auto size = sizeof(T);
-   const auto alignment = next_pot(size);
+   const auto alignment = alignof(T);
 
    const auto mem = info->pfnAllocation(info->pUserData, size, alignment, scope);
+   if (!mem)
+      return nullptr;
    return new (mem) T;
 }
 
-template<T>
+template<typename T>
 static void
 vk_delete(const VkAllocationCallbacks* const info, const T* const ptr)
 {
@@ -37,12 +41,12 @@ vk_delete(const VkAllocationCallbacks* const info, const T* const ptr)
       return;
 
    ptr->~T();
-   info->pfnFree(info->pUserData, ptr);
+   info->pfnFree(info->pUserData, (void*)ptr);
 }
 
 // -
 
-template<T>
+template<typename T>
 struct AllocWrapper final
 {
    T obj;
@@ -54,19 +58,19 @@ struct AllocWrapper final
    { }
 
    static const AllocWrapper<T>* From(const T* const ptr) {
-      auto pbytes = (char*)ptr;
-      return (const AllocWrapper<T>*)(pbytes - &AllocWrapper<T>::obj);
+      auto pbytes = (const char*)ptr;
+      return (const AllocWrapper<T>*)(pbytes - offsetof(AllocWrapper<T>, obj));
    }
 };
 
 // -
 
-template<T>
+template<typename T>
 static T*
 vk_new_internal(const VkAllocationCallbacks* const info,
                 const VkSystemAllocationScope scope = VK_SYSTEM_ALLOCATION_SCOPE_COMMAND)
 {
-   if (!has_internal_callbacks(info))
+   if (!HasInternalCallbacks(info))
       return vk_new<T>(info, scope);
 
    const auto wrapper = vk_new<AllocWrapper<T>>(info, scope);
@@ -80,11 +84,11 @@ vk_new_internal(const VkAllocationCallbacks* const info,
    return ptr;
 }
 
-template<T>
+template<typename T>
 static void
 vk_delete_internal(const VkAllocationCallbacks* const info, const T* const ptr)
 {
-   if (!has_internal_callbacks(info)) {
+   if (!HasInternalCallbacks(info)) {
       vk_delete(info, ptr);
       return;
    }
@@ -1,183 +1,1881 @@
+#include "vk_tiny_loader.h"
+
 #include "vulkan/vulkan.h"
+#include "vulkan/vk_icd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "api_subset.h"
+#include "api_trace.h"
+#include "dyn_lib.h"
+#include "elf_preflight.h"
 #include "find_icds.h"
-#include "tjson_cpp/tjson.h"
+#include "icd_caps_cache.h"
+#include "range.h"
+#include "sealed_config.h"
+#include "tramp_pool.h"
+#include "vk_new.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// Under an allowlist, vkGetInstanceProcAddr is our only export. (see api_subset.h)
+#if defined(VKTL_ALLOWED) && defined(__GNUC__)
+#define VKTL_EXPORT_UNLESS_SUBSET __attribute__((visibility("hidden")))
+#else
+#define VKTL_EXPORT_UNLESS_SUBSET VKTL_EXPORT
+#endif
+
+// -
+
+class IcdLib final
+{
+public:
+   const IcdInfo info_;
+   const std::unique_ptr<PlatformLib> lib_;
+   uint32_t iface_version_ = 0;
+   uint32_t refs_ = 0; // Live IcdInstances, plus temporary pins. See Loader::release_lib.
+
+   PFN_vkGetInstanceProcAddr pfnGetInstanceProcAddr = nullptr;
+   PFN_GetPhysicalDeviceProcAddr pfnGetPhysicalDeviceProcAddr = nullptr;
+
+   // Global commands:
+   PFN_vkEnumerateInstanceExtensionProperties pfnEnumerateInstanceExtensionProperties = nullptr;
+   PFN_vkEnumerateInstanceVersion pfnEnumerateInstanceVersion = nullptr;
+   PFN_vkCreateInstance pfnCreateInstance = nullptr;
+
+   // Failures go in the negative cache. (see fail_cache_find)
+   static std::unique_ptr<IcdLib> Load(const IcdInfo& info) {
+      const auto& path = info.library_path;
+      const auto fn_fail = [&](const std::string& err, const bool persist) {
+         debug_log("Not loading ICD %s: %s", path.c_str(), err.c_str());
+         fail_cache_store(path, err, persist);
+         return nullptr;
+      };
+
+      std::vector<std::string> exports;
+      std::string err;
+      if (!elf_preflight(path, &exports, &err))
+         return fn_fail(err, true);
+      // Not persisted: Installing a missing dependency would fix this without
+      // touching the ICD itself.
+      auto lib = PlatformLib::load(path, &err);
+      if (!lib)
+         return fn_fail(err, false);
+      auto ret = From(info, std::move(lib));
+      if (!ret)
+         return fn_fail("No vk_icdGetInstanceProcAddr.", true);
+      return ret;
+   }
+
+   static std::unique_ptr<IcdLib> From(const IcdInfo& info, std::unique_ptr<PlatformLib> lib) {
+      auto ret = as_unique(new IcdLib(info, std::move(lib)));
+      if (!ret->pfnGetInstanceProcAddr)
+         return nullptr;
+      return ret;
+   }
+
+private:
+   IcdLib(const IcdInfo& info, std::unique_ptr<PlatformLib> lib)
+      : info_(info)
+      , lib_(std::move(lib))
+   {
+      const auto negotiate = (PFN_vkNegotiateLoaderICDInterfaceVersion)
+         lib_->get_proc_address("vk_icdNegotiateLoaderICDInterfaceVersion");
+      if (negotiate) {
+         uint32_t version = CURRENT_LOADER_ICD_INTERFACE_VERSION;
+         if (negotiate(&version) != VK_SUCCESS)
+            return;
+         iface_version_ = std::min<uint32_t>(version, CURRENT_LOADER_ICD_INTERFACE_VERSION);
+      }
+
+      pfnGetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)
+         lib_->get_proc_address("vk_icdGetInstanceProcAddr");
+      if (!pfnGetInstanceProcAddr && !iface_version_) {
+         // Pre-negotiation ICDs may only export the real name.
+         pfnGetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)
+            lib_->get_proc_address("vkGetInstanceProcAddr");
+      }
+      if (!pfnGetInstanceProcAddr)
+         return;
+
+      if (iface_version_ >= 4) {
+         pfnGetPhysicalDeviceProcAddr = (PFN_GetPhysicalDeviceProcAddr)
+            lib_->get_proc_address("vk_icdGetPhysicalDeviceProcAddr");
+      }
+
+      const auto fn_global = [&](const char* const name) {
+         return pfnGetInstanceProcAddr(nullptr, name);
+      };
+      pfnEnumerateInstanceExtensionProperties = (PFN_vkEnumerateInstanceExtensionProperties)
+         fn_global("vkEnumerateInstanceExtensionProperties");
+      pfnEnumerateInstanceVersion = (PFN_vkEnumerateInstanceVersion)
+         fn_global("vkEnumerateInstanceVersion");
+      pfnCreateInstance = (PFN_vkCreateInstance)fn_global("vkCreateInstance");
+   }
+
+public:
+   std::unique_ptr<IcdCaps> query_caps() const {
+      auto ret = std::make_unique<IcdCaps>();
+      if (pfnEnumerateInstanceVersion) {
+         (void)pfnEnumerateInstanceVersion(&ret->instance_version);
+      }
+
+      if (pfnEnumerateInstanceExtensionProperties) {
+         auto& exts = ret->instance_exts;
+         while (true) {
+            uint32_t count = 0;
+            (void)pfnEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+            exts.resize(count);
+            const auto res = pfnEnumerateInstanceExtensionProperties(nullptr, &count,
+                                                                     exts.data());
+            if (res == VK_INCOMPLETE)
+               continue;
+            if (res != VK_SUCCESS)
+               return nullptr;
+            exts.resize(count);
+            break;
+         }
+      }
+      return ret;
+   }
+};
+
+// -
+
+// Instance-level commands the loader knows about, resolved once per ICD instance.
+#define FOR_EACH_INSTANCE_FN(X) \
+   X(DestroyInstance) \
+   X(EnumeratePhysicalDevices) \
+   X(GetPhysicalDeviceFeatures) \
+   X(GetPhysicalDeviceFormatProperties) \
+   X(GetPhysicalDeviceImageFormatProperties) \
+   X(GetPhysicalDeviceProperties) \
+   X(GetPhysicalDeviceQueueFamilyProperties) \
+   X(GetPhysicalDeviceMemoryProperties) \
+   X(CreateDevice) \
+   X(EnumerateDeviceExtensionProperties)
+
+struct InstanceDispatch final
+{
+#define _(x) PFN_vk##x x = nullptr;
+   FOR_EACH_INSTANCE_FN(_)
+#undef _
+};
+
+// At least two, for phys_dev_from() and instance_from(), even if an API subset
+// needs fewer.
+constexpr uint32_t PHYS_DEV_SLOT_COUNT = std::max(PHYS_DEV_TRAMP_COUNT, 2u);
+constexpr uint32_t DEVICE_SLOT_COUNT = std::max(DEVICE_TRAMP_COUNT, 1u);
+
+struct IcdInstance final
+{
+   IcdLib* lib = nullptr;
+   VkInstance handle = nullptr;
+   InstanceDispatch dispatch;
+
+   // Resolved tramp_pool slots for physical-device-level functions, and for
+   // instance-level ones, which share the pool. (see Loader::unknown_fn)
+   PFN_vkVoidFunction unknown_pfns[PHYS_DEV_SLOT_COUNT] = {};
+};
+
+// VK_TINY_LOADER_CACHE_PHYS_DEV_QUERIES=1 memoizes the physical-device queries
+// whose results are fixed for the life of the device.
+static bool
+phys_dev_query_cache_enabled()
+{
+   static const bool ret = []() {
+      const auto env = getenv("VK_TINY_LOADER_CACHE_PHYS_DEV_QUERIES");
+      return env && *env && std::string(env) != "0";
+   }();
+   return ret;
+}
+
+// With a single ICD and no layers, instances are passthrough: The app gets the
+// ICD's own instance and physical-device handles, and vkGetInstanceProcAddr hands
+// out the ICD's own functions, so instance-level calls skip the loader entirely.
+// VK_TINY_LOADER_PASSTHROUGH=0 always wraps instead, as does tracing.
+static bool
+passthrough_enabled()
+{
+   static const bool ret = []() {
+      const auto env = getenv("VK_TINY_LOADER_PASSTHROUGH");
+      return (!env || std::string(env) != "0") && !ApiTrace::enabled();
+   }();
+   return ret;
+}
+
+// Filled once, by whichever thread gets there first. Lock-free for readers.
+template<typename T>
+class CacheEntry final
+{
+   enum : uint8_t { EMPTY, FILLING, READY };
+   std::atomic<uint8_t> state_{EMPTY};
+   T val_;
+
+public:
+   const T* get() const {
+      if (state_.load(std::memory_order_acquire) != READY)
+         return nullptr;
+      return &val_;
+   }
+
+   // Null while another thread is mid-fill, in which case just ask the driver.
+   template<typename FillT>
+   const T* fill(const FillT& fill_fn) {
+      uint8_t expected = EMPTY;
+      if (!state_.compare_exchange_strong(expected, FILLING, std::memory_order_acq_rel))
+         return get();
+      fill_fn(&val_);
+      state_.store(READY, std::memory_order_release);
+      return &val_;
+   }
+};
+
+struct PhysDevQueryCache final
+{
+   // Core formats only. Extension formats aren't contiguous, and go uncached.
+   CacheEntry<VkFormatProperties> formats[VK_FORMAT_RANGE_SIZE];
+   CacheEntry<VkPhysicalDeviceProperties> props;
+   CacheEntry<VkPhysicalDeviceMemoryProperties> mem_props;
+   CacheEntry<std::vector<VkQueueFamilyProperties>> queue_families;
+};
+
+struct PhysDev final
+{
+   // Read by the tramp_pool trampolines. Don't reorder!
+   const PFN_vkVoidFunction* unknown_pfns = nullptr;
+   VkPhysicalDevice handle = nullptr;
+
+   const InstanceDispatch* dispatch = nullptr;
+   IcdLib* lib = nullptr;
+   IcdInstance* icd = nullptr;
+   std::unique_ptr<PhysDevQueryCache> query_cache; // If enabled.
+};
+static_assert(offsetof(PhysDev, unknown_pfns) == 0, "");
+static_assert(offsetof(PhysDev, handle) == sizeof(void*), "");
+
+// Drivers can spend tens of ms creating instances and first enumerating devices,
+// so those run on a thread per ICD. VK_TINY_LOADER_PARALLEL_ICDS=0 runs them
+// in order instead.
+static void
+for_each_icd(const size_t icd_count, const std::function<void(size_t)>& fn)
+{
+   static const bool parallel = []() {
+      const auto env = getenv("VK_TINY_LOADER_PARALLEL_ICDS");
+      return !env || std::string(env) != "0";
+   }();
+   if (parallel && icd_count > 1) {
+      fan_out(icd_count, fn);
+      return;
+   }
+   for (size_t i = 0; i < icd_count; i++) {
+      fn(i);
+   }
+}
+
+// Appends, so that many ICDs can share one vector.
+static void
+enum_icd_phys_devs(const IcdInstance& icd, std::vector<VkPhysicalDevice>* const out)
+{
+   const auto& fn_enum = icd.dispatch.EnumeratePhysicalDevices;
+   const auto prev_size = out->size();
+   while (true) {
+      uint32_t count = 0;
+      auto res = fn_enum(icd.handle, &count, nullptr);
+      if (res != VK_SUCCESS)
+         count = 0;
+      out->resize(prev_size + count);
+      if (!count)
+         break;
+      res = fn_enum(icd.handle, &count, out->data() + prev_size);
+      if (res == VK_INCOMPLETE)
+         continue;
+      if (res != VK_SUCCESS)
+         count = 0;
+      out->resize(prev_size + count);
+      break;
+   }
+}
+
+// For instances with several ICDs, which unknown instance-level commands aren't
+// handed out for.
+static const PFN_vkVoidFunction NO_INSTANCE_PFNS[PHYS_DEV_SLOT_COUNT] = {};
+
+// A VkInstance handed to the app points at one of these.
+struct Instance final
+{
+   // Read by instance_from(), and by the tramp_pool phys-dev trampolines, for
+   // instance-level commands. Don't reorder!
+   // With a single ICD, its slots and its own instance.
+   const PFN_vkVoidFunction* unknown_pfns = NO_INSTANCE_PFNS;
+   VkInstance handle = nullptr;
+
+   bool passthrough = false; // See passthrough_enabled().
+
+   std::vector<std::unique_ptr<IcdInstance>> icds;
+
+   std::mutex phys_devs_mutex;
+   // PhysDev records live in blocks that are reserved once and never grow past
+   // that, so wrapped handles stay put. Normally there's only the one block,
+   // sized by the first enumeration; later blocks are only for hotplug.
+   std::vector<std::vector<PhysDev>> phys_dev_blocks;
+   std::vector<VkPhysicalDevice> phys_devs; // As handed out, as of the last enumeration.
+
+private:
+   std::shared_ptr<const std::vector<VkPhysicalDevice>> phys_devs_snapshot_;
+
+   // Reused, so that repeat enumerations don't allocate.
+   std::vector<VkPhysicalDevice> icd_handles_scratch_;
+   std::vector<IcdInstance*> icd_owners_scratch_;
+
+   PhysDev* find_or_add_phys_dev(IcdInstance* const icd, const VkPhysicalDevice handle,
+                                 const size_t total_count)
+   {
+      for (auto& block : phys_dev_blocks) {
+         for (auto& pd : block) {
+            if (pd.handle == handle && pd.icd == icd)
+               return &pd;
+         }
+      }
+
+      if (phys_dev_blocks.empty() ||
+          phys_dev_blocks.back().size() == phys_dev_blocks.back().capacity())
+      {
+         phys_dev_blocks.emplace_back();
+         phys_dev_blocks.back().reserve(std::max<size_t>(total_count, 4));
+      }
+      auto& block = phys_dev_blocks.back();
+      block.push_back(PhysDev());
+      auto& ret = block.back();
+      ret.unknown_pfns = icd->unknown_pfns;
+      ret.handle = handle;
+      ret.dispatch = &icd->dispatch;
+      ret.lib = icd->lib;
+      ret.icd = icd;
+      if (phys_dev_query_cache_enabled()) {
+         ret.query_cache = as_unique(new PhysDevQueryCache);
+      }
+      return &ret;
+   }
+
+public:
+   // Call with phys_devs_mutex held. Only allocates if phys_devs changed.
+   std::shared_ptr<const std::vector<VkPhysicalDevice>> phys_devs_snapshot() {
+      if (!phys_devs_snapshot_ || *phys_devs_snapshot_ != phys_devs) {
+         phys_devs_snapshot_ = std::make_shared<const std::vector<VkPhysicalDevice>>(phys_devs);
+      }
+      return phys_devs_snapshot_;
+   }
+
+   // Call with phys_devs_mutex held.
+   void enumerate_phys_devs() {
+      icd_handles_scratch_.clear();
+      icd_owners_scratch_.clear();
+      if (phys_dev_blocks.empty()) {
+         // The first enumeration is where drivers tend to be slow.
+         std::vector<std::vector<VkPhysicalDevice>> handles_by_icd(icds.size());
+         for_each_icd(icds.size(), [&](const size_t i) {
+            enum_icd_phys_devs(*icds[i], &handles_by_icd[i]);
+         });
+         for (size_t i = 0; i < icds.size(); i++) {
+            const auto& handles = handles_by_icd[i];
+            icd_handles_scratch_.insert(icd_handles_scratch_.end(), handles.begin(),
+                                        handles.end());
+            icd_owners_scratch_.resize(icd_handles_scratch_.size(), icds[i].get());
+         }
+      } else {
+         for (const auto& icd : icds) {
+            enum_icd_phys_devs(*icd, &icd_handles_scratch_);
+            icd_owners_scratch_.resize(icd_handles_scratch_.size(), icd.get());
+         }
+      }
+
+      const auto total_count = icd_handles_scratch_.size();
+      phys_devs.clear();
+      for (size_t i = 0; i < total_count; i++) {
+         const auto pd = find_or_add_phys_dev(icd_owners_scratch_[i],
+                                              icd_handles_scratch_[i], total_count);
+         if (passthrough) {
+            // The ICD reserves the first word of its dispatchable objects for us.
+            *(PhysDev**)pd->handle = pd;
+            phys_devs.push_back(pd->handle);
+         } else {
+            phys_devs.push_back((VkPhysicalDevice)pd);
+         }
+      }
+   }
+};
+
+// Device handles are the ICD's own. Their loader-data word points at one of these.
+struct Device final
+{
+   // Read by the tramp_pool trampolines. Must be first!
+   PFN_vkVoidFunction unknown_pfns[DEVICE_SLOT_COUNT] = {};
+
+   VkDevice handle = nullptr;
+   PFN_vkGetDeviceProcAddr GetDeviceProcAddr = nullptr;
+   PFN_vkDestroyDevice DestroyDevice = nullptr;
+
+   // The ICD's own, under our wrappers. (see wrapped_fn)
+#define _(x) PFN_vk##x x = nullptr;
+   FOR_EACH_WRAPPED_DEVICE_FN(_)
+#undef _
+};
+static_assert(offsetof(Device, unknown_pfns) == 0, "");
+
+// Either our Instance, or a passthrough ICD instance whose loader-data word points
+// at our Instance, which points back. (As with phys_dev_from().)
+static Instance*
+instance_from(const VkInstance handle)
+{
+   const auto unwrapped = *(Instance**)handle;
+   if (unwrapped->handle == handle)
+      return unwrapped;
+   return (Instance*)handle;
+}
+
+// Either our PhysDev, or a passthrough ICD handle whose loader-data word points at
+// its PhysDev, which points back. (Our PhysDev's first word is its ICD's slots
+// instead, and slots never hold handles.)
+static PhysDev*
+phys_dev_from(const VkPhysicalDevice handle)
+{
+   const auto unwrapped = *(PhysDev**)handle;
+   if (unwrapped->handle == handle)
+      return unwrapped;
+   return (PhysDev*)handle;
+}
+
+static Device*
+device_from(const VkDevice handle)
+{
+   return *(Device**)handle;
+}
+
+// -
+// Drivers only say which unknown commands are physical-device-level, and only
+// from interface version 4 on. Like the Khronos loader, go by name for the rest.
+
+static bool
+starts_with(const char* const str, const char* const prefix)
+{
+   return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+// Commands that take the VkInstance itself: WSI surfaces and debug callbacks.
+// Names outside the API subset are null. (see api_subset.h)
+static bool
+is_instance_level_fn(const char* const name)
+{
+   static const char* const NAMES[] = {
+      VKTL_SUBSET_FN_NAME("vkDestroySurfaceKHR"),
+      VKTL_SUBSET_FN_NAME("vkCreateDebugReportCallbackEXT"),
+      VKTL_SUBSET_FN_NAME("vkDestroyDebugReportCallbackEXT"),
+      VKTL_SUBSET_FN_NAME("vkDebugReportMessageEXT"),
+      VKTL_SUBSET_FN_NAME("vkCreateDebugUtilsMessengerEXT"),
+      VKTL_SUBSET_FN_NAME("vkDestroyDebugUtilsMessengerEXT"),
+      VKTL_SUBSET_FN_NAME("vkSubmitDebugUtilsMessageEXT"),
+   };
+   if (starts_with(name, "vkCreate") && strstr(name, "Surface"))
+      return true; // vkCreateXlibSurfaceKHR, vkCreateHeadlessSurfaceEXT, etc.
+   for (const auto& x : NAMES) {
+      if (x && strcmp(x, name) == 0)
+         return true;
+   }
+   return false;
+}
+
+// For ICDs without vk_icdGetPhysicalDeviceProcAddr to ask. Names outside the API
+// subset are null, as above.
+static bool
+is_phys_dev_level_fn(const char* const name)
+{
+   static const char* const NAMES[] = {
+      VKTL_SUBSET_FN_NAME("vkCreateDisplayModeKHR"),
+      VKTL_SUBSET_FN_NAME("vkGetDisplayModePropertiesKHR"),
+      VKTL_SUBSET_FN_NAME("vkGetDisplayModeProperties2KHR"),
+      VKTL_SUBSET_FN_NAME("vkGetDisplayPlaneCapabilitiesKHR"),
+      VKTL_SUBSET_FN_NAME("vkGetDisplayPlaneCapabilities2KHR"),
+      VKTL_SUBSET_FN_NAME("vkGetDisplayPlaneSupportedDisplaysKHR"),
+      VKTL_SUBSET_FN_NAME("vkReleaseDisplayEXT"),
+      VKTL_SUBSET_FN_NAME("vkAcquireXlibDisplayEXT"),
+      VKTL_SUBSET_FN_NAME("vkGetRandROutputDisplayEXT"),
+      VKTL_SUBSET_FN_NAME("vkAcquireDrmDisplayEXT"),
+      VKTL_SUBSET_FN_NAME("vkGetDrmDisplayEXT"),
+      VKTL_SUBSET_FN_NAME("vkAcquireWinrtDisplayNV"),
+      VKTL_SUBSET_FN_NAME("vkGetWinrtDisplayNV"),
+   };
+   if (starts_with(name, "vkGetPhysicalDevice"))
+      return true;
+   if (starts_with(name, "vkEnumeratePhysicalDevice") &&
+       !starts_with(name, "vkEnumeratePhysicalDeviceGroups"))
+   {
+      return true; // vkEnumeratePhysicalDeviceQueueFamilyPerformanceQueryCountersKHR
+   }
+   for (const auto& x : NAMES) {
+      if (x && strcmp(x, name) == 0)
+         return true;
+   }
+   return false;
+}
+
+// -
+
+struct vktl::SnapshotGlobals final
+{
+   std::vector<IcdInfo> icd_infos;
+   std::vector<FoldedIcd> folded_icds;
+   std::vector<VkExtensionProperties> instance_exts;
+   std::vector<VkLayerProperties> layers;
+   uint32_t instance_version = VK_API_VERSION_1_0;
+};
+
+enum class SlotState : uint8_t {
+   RESOLVING,
+   READY,
+   ORPHANED, // Its resolving thread didn't survive a fork.
+};
+
+class Loader final
+{
+   const IcdFilter env_filter_ = IcdFilter::from_env();
+   IcdFilter app_filter_;
+
+   // VK_TINY_LOADER_KEEP_IDLE_ICDS=1 keeps unreferenced and device-less ICDs
+   // loaded, for drivers that don't survive being dlclose'd.
+   const bool keep_idle_icds_ = []() {
+      const auto env = getenv("VK_TINY_LOADER_KEEP_IDLE_ICDS");
+      return env && *env && std::string(env) != "0";
+   }();
+   std::atomic<uint64_t> reclaimed_bytes_{0};
+
+   // Replaces manifest discovery, unless VK_ICD_FILENAMES is set.
+   const std::unique_ptr<const std::vector<SealedIcd>> sealed_icds_ = []() {
+      std::unique_ptr<const std::vector<SealedIcd>> ret;
+      const auto path = sealed_config_path();
+      if (!path.size() || getenv("VK_ICD_FILENAMES"))
+         return ret;
+      std::string err;
+      ret = sealed_config_load(path, &err);
+      if (!ret) {
+         debug_log("Not using sealed config %s: %s", path.c_str(), err.c_str());
+      }
+      return ret;
+   }();
+   std::vector<IcdLib*> prefetch_pins_;
+
+   std::shared_ptr<const vktl::DeviceCriteria> device_criteria_;
+   std::shared_ptr<const vktl::SnapshotGlobals> snapshot_globals_; // Null if stale.
+
+   std::vector<IcdInfo> direct_icd_infos_; // Already in libs_by_path_.
+   bool direct_icds_exclusive_ = false;
+
+   std::vector<IcdInfo> icd_infos_;
+   std::vector<FoldedIcd> folded_icds_; // Left out of icd_infos_.
+   bool icd_infos_prefetched_ = false;
+   bool prefetch_scanning_ = false; // Without mutex_. See wait_for_prefetch_scan().
+   std::condition_variable prefetch_scanned_;
+   // Bumped whenever what a scan would find changes, so that a prefetch in flight
+   // knows its results are stale.
+   uint32_t scan_settings_gen_ = 0;
+   // Null while being loaded, without mutex_. See acquire_lib().
+   std::unordered_map<std::string, std::unique_ptr<IcdLib>> libs_by_path_;
+   std::condition_variable lib_loaded_;
+   // Never erased, so pointers to entries stay good without mutex_.
+   std::unordered_map<std::string, std::unique_ptr<IcdCaps>> caps_by_path_;
+
+   // Enumerables:
+   std::vector<VkLayerProperties> layer_props_;
+
+   // Live objects, so that newly assigned tramp_pool slots reach all of them.
+   std::vector<Instance*> instances_;
+   std::vector<Device*> devices_;
+   std::vector<std::string> phys_dev_fn_names_; // Indexed by slot.
+   std::vector<bool> instance_fn_slots_; // Those of phys_dev_fn_names_ that are.
+   std::vector<std::string> device_fn_names_;
+   // New slots are resolved for the live objects without mutex_, by whichever
+   // thread added them. Their trampolines are only handed out once that's done,
+   // and objects aren't destroyed while it's in progress. See claim_slot().
+   std::vector<SlotState> phys_dev_slot_states_;
+   std::vector<SlotState> device_slot_states_;
+   uint32_t slots_resolving_ = 0;
+   std::condition_variable slots_resolved_;
+
+public:
+   // Guards everything below. Held per step rather than per API call where
+   // possible, so e.g. the prefetch thread never blocks the app for long.
+   std::mutex mutex_;
+
+   // Never destroyed: Atexit handlers and other threads can still call in during
+   // static destruction, with instances whose ICDs must stay loaded.
+   static Loader& Get() {
+      static Loader* const s_loader = new Loader;
+      return *s_loader;
+   }
+
+private:
+   Loader() {
+#ifndef _WIN32
+      // Don't fork while another thread holds mutex_. In the child, loads and
+      // scans that other threads had in flight never finish, so forget them.
+      (void)pthread_atfork([]() { Loader::Get().mutex_.lock(); },
+                           []() { Loader::Get().mutex_.unlock(); },
+                           []() { Loader::Get().after_fork_child(); });
+#endif
+   }
+
+   // Unlocks mutex_, which the prepare handler took.
+   void after_fork_child() {
+      prefetch_scanning_ = false;
+      slots_resolving_ = 0;
+      for (auto* states : { &phys_dev_slot_states_, &device_slot_states_ }) {
+         for (auto& state : *states) {
+            if (state == SlotState::RESOLVING) {
+               state = SlotState::ORPHANED;
+            }
+         }
+      }
+      for (auto itr = libs_by_path_.begin(); itr != libs_by_path_.end();) {
+         if (itr->second) {
+            ++itr;
+            continue;
+         }
+         itr = libs_by_path_.erase(itr);
+      }
+      mutex_.unlock();
+   }
+
+public:
+   // Only touches the filesystem, so this doesn't need mutex_. Pass in copies of
+   // direct_icd_infos_ and app_filter_.
+   // Streams each accepted ICD to `fn` as soon as it's found. Return false from
+   // `fn` to stop scanning.
+   // Duplicates are left out, and appended to out_folded, if any.
+   void scan_icd_infos(const std::vector<IcdInfo>& direct_icds,
+                       const bool direct_icds_exclusive, const IcdFilter& app_filter,
+                       const std::function<bool(const IcdInfo&)>& fn_accepted,
+                       std::vector<FoldedIcd>* const out_folded = nullptr) const
+   {
+      // So that each driver is loaded and probed once.
+      IcdDedup dedup;
+      const auto fn = [&](const IcdInfo& info) {
+         std::string first;
+         if (!dedup.add(info, &first)) {
+            const auto& path = info.json_path.size() ? info.json_path
+                                                     : info.library_path;
+            debug_log("Folded ICD %s into %s: Same file.", path.c_str(),
+                      first.c_str());
+            if (out_folded) {
+               out_folded->push_back({ path, first });
+            }
+            return true;
+         }
+         return fn_accepted(info);
+      };
+
+      for (const auto& info : direct_icds) {
+         if (!fn(info))
+            return;
+      }
+      if (direct_icds_exclusive)
+         return;
+
+      if (sealed_icds_) {
+         for (const auto& sealed : *sealed_icds_) {
+            const auto& info = sealed.info;
+            if (!env_filter_.accepts(info) || !app_filter.accepts(info))
+               continue;
+            if (!fn(info))
+               return;
+         }
+         return;
+      }
+
+      for_each_icd_manifest([&](const std::string& path,
+                                const std::vector<uint8_t>* const bytes,
+                                const std::string& read_err)
+      {
+         std::string err;
+         if (fail_cache_find(path, &err))
+            return true; // Known bad, and unchanged since.
+         err = read_err;
+         const auto info = bytes ? IcdInfo::from_bytes(path, *bytes, &err) : nullptr;
+         if (!info) {
+            debug_log("Bad ICD manifest %s: %s", path.c_str(), err.c_str());
+            fail_cache_store(path, err, true);
+            return true;
+         }
+         if (!env_filter_.accepts(*info) || !app_filter.accepts(*info))
+            return true;
+         return fn(*info);
+      });
+   }
+
+   std::vector<IcdInfo> scan_icd_infos(const std::vector<IcdInfo>& direct_icds,
+                                       const bool direct_icds_exclusive,
+                                       const IcdFilter& app_filter,
+                                       std::vector<FoldedIcd>* const out_folded = nullptr) const
+   {
+      std::vector<IcdInfo> ret;
+      scan_icd_infos(direct_icds, direct_icds_exclusive, app_filter,
+                     [&](const IcdInfo& info) {
+         ret.push_back(info);
+         return true;
+      }, out_folded);
+      return ret;
+   }
+
+   // Call with mutex_ held. Gives up mutex_ while waiting.
+   void wait_for_prefetch_scan() {
+      std::unique_lock<std::mutex> lock(mutex_, std::adopt_lock);
+      prefetch_scanned_.wait(lock, [&]() { return !prefetch_scanning_; });
+      (void)lock.release(); // Still held, by our caller.
+   }
+
+   // Takes mutex_ itself, and scans without it.
+   std::vector<IcdInfo> icd_infos(std::vector<FoldedIcd>* const out_folded = nullptr) {
+      std::vector<IcdInfo> direct_icds;
+      bool direct_icds_exclusive;
+      IcdFilter app_filter;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         wait_for_prefetch_scan();
+         if (icd_infos_prefetched_) {
+            icd_infos_prefetched_ = false;
+            if (out_folded) {
+               *out_folded = folded_icds_;
+            }
+            return icd_infos_;
+         }
+         direct_icds = direct_icd_infos_;
+         direct_icds_exclusive = direct_icds_exclusive_;
+         app_filter = app_filter_;
+      }
+      return scan_icd_infos(direct_icds, direct_icds_exclusive, app_filter, out_folded);
+   }
+
+   // Loads if needed. Every acquire_lib needs a matching release_lib.
+   // Takes mutex_ itself, and loads without it, so that one slow driver only
+   // holds up the threads that want that same driver.
+   IcdLib* acquire_lib(const IcdInfo& icd) {
+      const auto& path = icd.library_path;
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (true) {
+         const auto res = libs_by_path_.insert({ path, nullptr });
+         const bool& did_insert = res.second;
+         const auto& lib = res.first->second;
+         if (did_insert)
+            break;
+         if (lib) {
+            lib->refs_ += 1;
+            return lib.get();
+         }
+         lib_loaded_.wait(lock); // Someone else is loading it.
+      }
+      lock.unlock();
+
+      std::unique_ptr<IcdLib> lib;
+      std::string reason;
+      if (!fail_cache_find(path, &reason)) {
+         lib = IcdLib::Load(icd);
+      }
+
+      lock.lock();
+      const auto ret = lib.get();
+      if (lib) {
+         lib->refs_ += 1;
+         libs_by_path_[path] = std::move(lib);
+      } else {
+         libs_by_path_.erase(path);
+      }
+      lib_loaded_.notify_all();
+      return ret;
+   }
+
+   // Call with mutex_ held. Once nothing references the ICD anymore, moves it to
+   // `out_idle`, for unload_libs() once mutex_ is released.
+   void release_lib(IcdLib* const lib,
+                    std::vector<std::unique_ptr<IcdLib>>* const out_idle)
+   {
+      lib->refs_ -= 1;
+      if (lib->refs_ || keep_idle_icds_)
+         return;
+
+      const auto itr = libs_by_path_.find(lib->info_.library_path);
+      out_idle->push_back(std::move(itr->second));
+      libs_by_path_.erase(itr);
+   }
+
+   // Call without mutex_, since dlclose runs the drivers' destructors.
+   void unload_libs(std::vector<std::unique_ptr<IcdLib>>* const idle) {
+      for (auto& lib : *idle) {
+         const auto before = loaded_image_bytes();
+         const auto path = lib->info_.library_path;
+         lib = nullptr;
+         const auto after = loaded_image_bytes();
+         if (before > after) {
+            reclaimed_bytes_ += before - after;
+         }
+         debug_log("Unloaded idle ICD %s, reclaiming %zu bytes.", path.c_str(),
+                   size_t(before > after ? before - after : 0));
+      }
+      idle->clear();
+   }
+
+   uint64_t reclaimed_bytes() const {
+      return reclaimed_bytes_;
+   }
+
+   // Runs on the prefetch thread. Takes mutex_ itself, one step at a time, and
+   // scans and loads without it, so that fork() never waits on the filesystem.
+   // Calls that need the scan wait for it instead.
+   void prefetch(const bool should_load, const std::atomic<bool>& should_stop) {
+      std::vector<IcdInfo> direct_icds;
+      bool direct_icds_exclusive;
+      IcdFilter app_filter;
+      uint32_t gen;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         direct_icds = direct_icd_infos_;
+         direct_icds_exclusive = direct_icds_exclusive_;
+         app_filter = app_filter_;
+         gen = scan_settings_gen_;
+         prefetch_scanning_ = true;
+      }
+      std::vector<FoldedIcd> folded;
+      auto icds = scan_icd_infos(direct_icds, direct_icds_exclusive, app_filter,
+                                 &folded);
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         prefetch_scanning_ = false;
+         prefetch_scanned_.notify_all();
+         if (gen != scan_settings_gen_)
+            return;
+         icd_infos_ = icds;
+         folded_icds_ = std::move(folded);
+         icd_infos_prefetched_ = true;
+      }
+      if (!should_load)
+         return;
+
+      for (const auto& icd : icds) {
+         if (should_stop)
+            return;
+         {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            if (gen != scan_settings_gen_)
+               return;
+         }
+         const auto lib = acquire_lib(icd);
+         if (!lib)
+            continue;
+         std::vector<std::unique_ptr<IcdLib>> idle;
+         {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            if (gen == scan_settings_gen_) {
+               prefetch_pins_.push_back(lib); // Until the first vkCreateInstance.
+               continue;
+            }
+            release_lib(lib, &idle); // Changed while loading.
+         }
+         unload_libs(&idle);
+         return;
+      }
+   }
+
+private:
+   // Call with mutex_ held. Prefetched ICDs were found with the old settings.
+   void scan_settings_changed(std::vector<std::unique_ptr<IcdLib>>* const out_idle) {
+      scan_settings_gen_ += 1;
+      icd_infos_prefetched_ = false;
+      for (const auto& lib : prefetch_pins_) {
+         release_lib(lib, out_idle);
+      }
+      prefetch_pins_.clear();
+      snapshot_globals_ = nullptr;
+   }
+
+public:
+   // These three take mutex_ themselves.
+
+   void set_app_filter(const IcdFilter& filter) {
+      std::vector<std::unique_ptr<IcdLib>> idle;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         app_filter_ = filter;
+         scan_settings_changed(&idle);
+      }
+      unload_libs(&idle);
+   }
+
+   bool add_direct_icd(std::unique_ptr<PlatformLib> platform_lib, const std::string& name) {
+      IcdInfo info;
+      info.library_path = "direct:" + name;
+      auto lib = IcdLib::From(info, std::move(platform_lib));
+      if (!lib)
+         return false;
+      lib->refs_ += 1; // Forever.
+
+      std::vector<std::unique_ptr<IcdLib>> idle;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         if (libs_by_path_.count(info.library_path))
+            return false;
+         libs_by_path_[info.library_path] = std::move(lib);
+         direct_icd_infos_.push_back(info);
+         scan_settings_changed(&idle);
+      }
+      unload_libs(&idle);
+      return true;
+   }
+
+   void set_direct_icds_exclusive(const bool exclusive) {
+      std::vector<std::unique_ptr<IcdLib>> idle;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         direct_icds_exclusive_ = exclusive;
+         scan_settings_changed(&idle);
+      }
+      unload_libs(&idle);
+   }
+
+   void set_device_criteria(const vktl::DeviceCriteria* const criteria) {
+      device_criteria_ = nullptr;
+      if (criteria) {
+         device_criteria_ = std::make_shared<const vktl::DeviceCriteria>(*criteria);
+      }
+   }
+
+private:
+   // Answers from the caps cache when possible, so that global queries don't have
+   // to dlopen anything.
+   std::unique_ptr<IcdCaps> load_caps(const IcdInfo& icd) {
+      if (sealed_icds_) {
+         for (const auto& sealed : *sealed_icds_) {
+            if (sealed.info.library_path == icd.library_path && sealed.caps)
+               return std::make_unique<IcdCaps>(*sealed.caps);
+         }
+      }
+
+      const bool use_cache = caps_cache_enabled();
+      if (use_cache) {
+         auto ret = caps_cache_load(icd.library_path);
+         if (ret)
+            return ret;
+      }
+
+      const auto lib = acquire_lib(icd);
+      if (!lib)
+         return nullptr;
+      auto ret = lib->query_caps();
+      std::vector<std::unique_ptr<IcdLib>> idle;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         release_lib(lib, &idle);
+      }
+      unload_libs(&idle);
+      if (ret && use_cache) {
+         caps_cache_store(icd.library_path, *ret);
+      }
+      return ret;
+   }
+
+public:
+   // Takes mutex_ itself, and loads without it.
+   const IcdCaps* caps(const IcdInfo& icd) {
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         const auto itr = caps_by_path_.find(icd.library_path);
+         if (itr != caps_by_path_.end())
+            return itr->second.get();
+      }
+      auto caps = load_caps(icd);
+      if (!caps)
+         return nullptr;
+
+      const std::lock_guard<std::mutex> lock(mutex_);
+      auto& ret = caps_by_path_[icd.library_path];
+      if (!ret) { // Unless another thread got here first.
+         ret = std::move(caps);
+      }
+      return ret.get();
+   }
+
+   // The rest of these global queries take mutex_ as needed, too.
+
+   void merge_instance_exts(const std::vector<IcdInfo>& icds,
+                            std::vector<VkExtensionProperties>* const out)
+   {
+      for (const auto& icd : icds) {
+         const auto caps = this->caps(icd);
+         if (!caps)
+            continue;
+         for (const auto& ext : caps->instance_exts) {
+            if (!api_subset_allows_ext(ext.extensionName))
+               continue;
+            const auto itr = std::find_if(out->begin(), out->end(), [&](const auto& x) {
+               return strcmp(x.extensionName, ext.extensionName) == 0;
+            });
+            if (itr == out->end()) {
+               out->push_back(ext);
+               continue;
+            }
+            itr->specVersion = std::max(itr->specVersion, ext.specVersion);
+         }
+      }
+   }
+
+   std::vector<VkExtensionProperties> instance_exts(const std::string& layer_name) {
+      std::vector<VkExtensionProperties> ret;
+      if (layer_name.size())
+         return ret; // No layer support yet.
+
+      merge_instance_exts(icd_infos(), &ret);
+      return ret;
+   }
+
+   uint32_t instance_version() {
+      return instance_version(icd_infos());
+   }
+
+   uint32_t instance_version(const std::vector<IcdInfo>& icds) {
+      uint32_t ret = VK_API_VERSION_1_0;
+      for (const auto& icd : icds) {
+         const auto caps = this->caps(icd);
+         if (!caps)
+            continue;
+         ret = std::max(ret, caps->instance_version);
+      }
+      return std::min(ret, MAX_API_VERSION);
+   }
+
+   // Call with mutex_ held.
+   const auto& layer_props() {
+      return layer_props_;
+   }
+
+   std::shared_ptr<const vktl::SnapshotGlobals> snapshot_globals() {
+      uint32_t gen;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         if (snapshot_globals_)
+            return snapshot_globals_;
+         gen = scan_settings_gen_;
+      }
+      auto globals = std::make_shared<vktl::SnapshotGlobals>();
+      globals->icd_infos = icd_infos(&globals->folded_icds);
+      merge_instance_exts(globals->icd_infos, &globals->instance_exts);
+      globals->instance_version = instance_version(globals->icd_infos);
+
+      const std::lock_guard<std::mutex> lock(mutex_);
+      globals->layers = layer_props_;
+      if (gen == scan_settings_gen_) { // Else already stale.
+         snapshot_globals_ = globals;
+      }
+      return globals;
+   }
+
+   // -
+
+private:
+   static std::unique_ptr<IcdInstance> create_icd_instance(IcdLib* const lib,
+                                                           const IcdCaps* const caps,
+                                                           const VkInstanceCreateInfo& info,
+                                                           const VkAllocationCallbacks* const alloc)
+   {
+      if (!caps || !lib->pfnCreateInstance)
+         return nullptr;
+
+      // Only pass along the extensions this ICD has.
+      std::vector<const char*> exts;
+      for (uint32_t i = 0; i < info.enabledExtensionCount; i++) {
+         const auto& name = info.ppEnabledExtensionNames[i];
+         for (const auto& ext : caps->instance_exts) {
+            if (strcmp(ext.extensionName, name) == 0) {
+               exts.push_back(name);
+               break;
+            }
+         }
+      }
+      auto icd_info = info;
+      icd_info.enabledExtensionCount = exts.size();
+      icd_info.ppEnabledExtensionNames = exts.data();
+
+      VkApplicationInfo app_info;
+      if (info.pApplicationInfo) {
+         auto api_version = std::min(info.pApplicationInfo->apiVersion, MAX_API_VERSION);
+         // Pre-v5 1.0 ICDs are allowed to reject apiVersions they don't know.
+         if (lib->iface_version_ < 5 && caps->instance_version < VK_API_VERSION_1_1) {
+            api_version = VK_API_VERSION_1_0;
+         }
+         if (api_version != info.pApplicationInfo->apiVersion) {
+            app_info = *info.pApplicationInfo;
+            app_info.apiVersion = api_version;
+            icd_info.pApplicationInfo = &app_info;
+         }
+      }
+
+      auto ret = std::make_unique<IcdInstance>();
+      ret->lib = lib;
+      if (lib->pfnCreateInstance(&icd_info, alloc, &ret->handle) != VK_SUCCESS)
+         return nullptr;
+
+      const auto& gipa = lib->pfnGetInstanceProcAddr;
+#define _(x) ret->dispatch.x = (PFN_vk##x)gipa(ret->handle, "vk" #x);
+      FOR_EACH_INSTANCE_FN(_)
+#undef _
+      return ret;
+   }
+
+   static void destroy_icd_instance(IcdInstance* const icd,
+                                    const VkAllocationCallbacks* const alloc)
+   {
+      if (icd->dispatch.DestroyInstance) {
+         icd->dispatch.DestroyInstance(icd->handle, alloc);
+      }
+   }
+
+   static bool has_exts(const std::vector<VkExtensionProperties>& supported,
+                        const VkInstanceCreateInfo& info)
+   {
+      for (uint32_t i = 0; i < info.enabledExtensionCount; i++) {
+         const auto& name = info.ppEnabledExtensionNames[i];
+         if (!api_subset_allows_ext(name))
+            return false;
+         const auto itr = std::find_if(supported.begin(), supported.end(),
+                                       [&](const auto& x) {
+            return strcmp(x.extensionName, name) == 0;
+         });
+         if (itr == supported.end())
+            return false;
+      }
+      return true;
+   }
+
+   // Judged from the manifest alone, without loading anything.
+   static bool may_match(const vktl::DeviceCriteria& criteria, const IcdInfo& icd) {
+      if (!criteria.min_api_version)
+         return true;
+      uint32_t major, minor, patch = 0;
+      if (sscanf(icd.vk_api_version.c_str(), "%u.%u.%u", &major, &minor, &patch) < 2)
+         return true; // Unknown, so probe it.
+      return VK_MAKE_VERSION(major, minor, patch) >= criteria.min_api_version;
+   }
+
+   static bool has_matching_phys_dev(const vktl::DeviceCriteria& criteria,
+                                     const IcdInstance& icd)
+   {
+      const auto& d = icd.dispatch;
+      uint32_t count = 0;
+      if (d.EnumeratePhysicalDevices(icd.handle, &count, nullptr) != VK_SUCCESS)
+         return false;
+      std::vector<VkPhysicalDevice> handles(count);
+      const auto res = d.EnumeratePhysicalDevices(icd.handle, &count, handles.data());
+      if (res != VK_SUCCESS && res != VK_INCOMPLETE)
+         return false;
+      handles.resize(count);
+
+      for (const auto& handle : handles) {
+         VkPhysicalDeviceProperties props;
+         d.GetPhysicalDeviceProperties(handle, &props);
+         if (!criteria.accepts(props))
+            continue;
+         if (criteria.device_exts.empty())
+            return true;
+
+         uint32_t ext_count = 0;
+         if (d.EnumerateDeviceExtensionProperties(handle, nullptr, &ext_count,
+                                                  nullptr) != VK_SUCCESS)
+         {
+            continue;
+         }
+         std::vector<VkExtensionProperties> exts(ext_count);
+         if (d.EnumerateDeviceExtensionProperties(handle, nullptr, &ext_count,
+                                                  exts.data()) != VK_SUCCESS)
+         {
+            continue;
+         }
+         exts.resize(ext_count);
+         const bool has_all = std::all_of(criteria.device_exts.begin(),
+                                          criteria.device_exts.end(),
+                                          [&](const std::string& name) {
+            return std::any_of(exts.begin(), exts.end(), [&](const auto& x) {
+               return name == x.extensionName;
+            });
+         });
+         if (has_all)
+            return true;
+      }
+      return false;
+   }
+
+   static bool has_phys_devs(const IcdInstance& icd) {
+      uint32_t count = 0;
+      const auto res = icd.dispatch.EnumeratePhysicalDevices(icd.handle, &count, nullptr);
+      return res == VK_SUCCESS && count;
+   }
+
+   // ICDs without devices just take up address space, unless they're all we have.
+   static void drop_deviceless_icds(Instance* const inst,
+                                    const std::vector<uint8_t>& has_devices,
+                                    const VkAllocationCallbacks* const alloc)
+   {
+      if (std::find(has_devices.begin(), has_devices.end(), true) == has_devices.end())
+         return;
+
+      auto keep_itr = inst->icds.begin();
+      for (size_t i = 0; i < inst->icds.size(); i++) {
+         auto& icd = inst->icds[i];
+         if (has_devices[i]) {
+            *keep_itr = std::move(icd);
+            ++keep_itr;
+            continue;
+         }
+         debug_log("Dropping ICD %s: No physical devices.", icd->lib->info_.library_path.c_str());
+         destroy_icd_instance(icd.get(), alloc);
+      }
+      inst->icds.erase(keep_itr, inst->icds.end());
+   }
+
+   static void resolve_phys_dev_slot(IcdInstance* const icd, const uint32_t slot,
+                                     const std::string& name, const bool is_instance_fn)
+   {
+      const auto& lib = *icd->lib;
+      if (lib.pfnGetPhysicalDeviceProcAddr && !is_instance_fn) {
+         icd->unknown_pfns[slot] = lib.pfnGetPhysicalDeviceProcAddr(icd->handle,
+                                                                     name.c_str());
+      } else {
+         icd->unknown_pfns[slot] = lib.pfnGetInstanceProcAddr(icd->handle, name.c_str());
+      }
+   }
+
+   static void resolve_device_slot(Device* const dev, const uint32_t slot,
+                                   const std::string& name)
+   {
+      dev->unknown_pfns[slot] = dev->GetDeviceProcAddr(dev->handle, name.c_str());
+   }
+
+   static uint32_t find_or_add_slot(std::vector<std::string>* const names,
+                                    const char* const name, const uint32_t max_slots,
+                                    bool* const out_is_new)
+   {
+      *out_is_new = false;
+      const auto itr = std::find(names->begin(), names->end(), name);
+      if (itr != names->end())
+         return itr - names->begin();
+      if (names->size() == max_slots)
+         return UINT32_MAX;
+
+      names->push_back(name);
+      *out_is_new = true;
+      return names->size() - 1;
+   }
+
+   // Call with mutex_ held, via `lock`. True if the caller is to resolve `slot`
+   // for the live objects, without mutex_, and then call slot_resolved(). If
+   // another thread already is, waits for it instead.
+   bool claim_slot(std::unique_lock<std::mutex>& lock,
+                   std::vector<SlotState>* const states, const uint32_t slot)
+   {
+      if (slot == states->size()) {
+         states->push_back(SlotState::ORPHANED); // New, so claimed just below.
+      }
+      if ((*states)[slot] == SlotState::ORPHANED) {
+         (*states)[slot] = SlotState::RESOLVING;
+         slots_resolving_ += 1;
+         return true;
+      }
+      slots_resolved_.wait(lock, [&]() { return (*states)[slot] == SlotState::READY; });
+      return false;
+   }
+
+   // Call with mutex_ held.
+   void slot_resolved(std::vector<SlotState>* const states, const uint32_t slot) {
+      (*states)[slot] = SlotState::READY;
+      slots_resolving_ -= 1;
+      slots_resolved_.notify_all();
+   }
+
+   // Call with mutex_ held, via `lock`. Before destroying an object that a
+   // thread might be resolving slots for.
+   void wait_for_slots(std::unique_lock<std::mutex>& lock) {
+      slots_resolved_.wait(lock, [&]() { return !slots_resolving_; });
+   }
+
+public:
+   // Takes mutex_ itself, and never across calls into the ICDs, so that
+   // instances can be created and destroyed concurrently from many threads.
+   VkResult create_instance(const VkInstanceCreateInfo& info,
+                            const VkAllocationCallbacks* const alloc,
+                            VkInstance* const out)
+   {
+      std::vector<IcdInfo> icds;
+      std::vector<IcdInfo> direct_icds;
+      bool direct_icds_exclusive = false;
+      IcdFilter app_filter;
+      std::shared_ptr<const vktl::DeviceCriteria> criteria;
+      bool was_prefetched = false;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         wait_for_prefetch_scan();
+         criteria = device_criteria_;
+         was_prefetched = icd_infos_prefetched_;
+         if (was_prefetched) {
+            icd_infos_prefetched_ = false;
+            icds = icd_infos_;
+         } else {
+            direct_icds = direct_icd_infos_;
+            direct_icds_exclusive = direct_icds_exclusive_;
+            app_filter = app_filter_;
+         }
+      }
+      // With device criteria, the scan is streamed into the probing below instead.
+      if (!was_prefetched && !criteria) {
+         icds = scan_icd_infos(direct_icds, direct_icds_exclusive, app_filter);
+      }
+
+      // Pin every candidate up front, so that nothing gets dlclose'd and reopened
+      // midway. Once warm, this is just bookkeeping.
+      // With device criteria, ICDs are instead pinned one at a time as they're
+      // probed, and extensions are checked per ICD, so that nothing past the first
+      // match gets loaded, or even found.
+      std::vector<std::pair<IcdLib*, const IcdCaps*>> pins;
+      auto res = VK_SUCCESS;
+      if (!criteria) {
+         for (const auto& icd : icds) {
+            const auto lib = acquire_lib(icd);
+            if (lib) {
+               pins.push_back({ lib, caps(icd) });
+            }
+         }
+      }
+      std::vector<std::unique_ptr<IcdLib>> idle;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         for (const auto& lib : prefetch_pins_) {
+            release_lib(lib, &idle);
+         }
+         prefetch_pins_.clear();
+      }
+      unload_libs(&idle);
+      if (!criteria) {
+         std::vector<VkExtensionProperties> supported;
+         merge_instance_exts(icds, &supported);
+         if (!has_exts(supported, info)) {
+            res = VK_ERROR_EXTENSION_NOT_PRESENT;
+         }
+      }
+
+      Instance* inst = nullptr;
+      if (res == VK_SUCCESS) {
+         inst = vk_new<Instance>(alloc, VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE);
+         if (!inst) {
+            res = VK_ERROR_OUT_OF_HOST_MEMORY;
+         }
+      }
+      if (inst && criteria) {
+         bool missing_exts = false;
+         // False once matched.
+         const auto fn_probe = [&](const IcdInfo& icd) {
+            if (!may_match(*criteria, icd)) {
+               debug_log("Skipping ICD %s: api_version %s is too low.",
+                         icd.library_path.c_str(), icd.vk_api_version.c_str());
+               return true;
+            }
+            const auto lib = acquire_lib(icd);
+            if (!lib)
+               return true;
+            const auto caps = this->caps(icd);
+            pins.push_back({ lib, caps });
+            if (!caps || !has_exts(caps->instance_exts, info)) {
+               missing_exts = true;
+               return true;
+            }
+
+            auto icd_inst = create_icd_instance(lib, caps, info, alloc);
+            if (!icd_inst)
+               return true;
+            if (!has_matching_phys_dev(*criteria, *icd_inst)) {
+               destroy_icd_instance(icd_inst.get(), alloc);
+               return true;
+            }
+            inst->icds.push_back(std::move(icd_inst));
+            return false;
+         };
+         if (was_prefetched) {
+            for (const auto& icd : icds) {
+               if (!fn_probe(icd))
+                  break;
+            }
+         } else {
+            scan_icd_infos(direct_icds, direct_icds_exclusive, app_filter, fn_probe);
+         }
+         if (inst->icds.empty()) {
+            vk_delete(alloc, inst);
+            inst = nullptr;
+            res = missing_exts ? VK_ERROR_EXTENSION_NOT_PRESENT
+                               : VK_ERROR_INCOMPATIBLE_DRIVER;
+         }
+      } else if (inst) {
+         // Each ICD fills its own slots, and a failing ICD just leaves them empty.
+         // Merging in pin order keeps results independent of timing.
+         std::vector<std::unique_ptr<IcdInstance>> icd_insts(pins.size());
+         std::vector<uint8_t> has_devices(pins.size()); // Not vector<bool>, for threads.
+         for_each_icd(pins.size(), [&](const size_t i) {
+            const auto& pin = pins[i];
+            icd_insts[i] = create_icd_instance(pin.first, pin.second, info, alloc);
+            if (icd_insts[i] && !keep_idle_icds_) {
+               has_devices[i] = has_phys_devs(*icd_insts[i]);
+            }
+         });
+         std::vector<uint8_t> kept_has_devices;
+         for (size_t i = 0; i < pins.size(); i++) {
+            if (!icd_insts[i])
+               continue;
+            inst->icds.push_back(std::move(icd_insts[i]));
+            kept_has_devices.push_back(has_devices[i]);
+         }
+         if (!keep_idle_icds_) {
+            drop_deviceless_icds(inst, kept_has_devices, alloc);
+         }
+         if (inst->icds.empty()) {
+            vk_delete(alloc, inst);
+            inst = nullptr;
+            res = VK_ERROR_INCOMPATIBLE_DRIVER;
+         }
+      }
+      if (inst && inst->icds.size() == 1) {
+         inst->unknown_pfns = inst->icds[0]->unknown_pfns;
+         inst->handle = inst->icds[0]->handle;
+      }
+      if (inst && inst->icds.size() == 1 && passthrough_enabled()) {
+         // Layers were already refused, in vkCreateInstance.
+         const auto& icd = *inst->icds[0];
+         inst->passthrough = true;
+         *(Instance**)icd.handle = inst;
+         // Stamp the physical devices up front, so that handles the app gets
+         // straight from the ICD (e.g. vkEnumeratePhysicalDeviceGroups) work with
+         // our entrypoints too.
+         const std::lock_guard<std::mutex> lock(inst->phys_devs_mutex);
+         inst->enumerate_phys_devs();
+      }
+
+      // Resolve the slots assigned so far without mutex_, and again for any
+      // assigned meanwhile, until there are none, and then publish under it.
+      {
+         std::unique_lock<std::mutex> lock(mutex_);
+         if (inst) {
+            uint32_t resolved = 0;
+            while (resolved < phys_dev_fn_names_.size()) {
+               const auto begin = resolved;
+               const std::vector<std::string> fn_names(phys_dev_fn_names_.begin() + begin,
+                                                       phys_dev_fn_names_.end());
+               const std::vector<bool> instance_fn_slots(
+                  instance_fn_slots_.begin() + begin, instance_fn_slots_.end());
+               lock.unlock();
+               for (const auto& icd : inst->icds) {
+                  for (uint32_t i = 0; i < fn_names.size(); i++) {
+                     resolve_phys_dev_slot(icd.get(), begin + i, fn_names[i],
+                                           instance_fn_slots[i]);
+                  }
+               }
+               lock.lock();
+               resolved += fn_names.size();
+            }
+            for (const auto& icd : inst->icds) {
+               icd->lib->refs_ += 1;
+            }
+            instances_.push_back(inst);
+         }
+         for (const auto& pin : pins) {
+            release_lib(pin.first, &idle);
+         }
+      }
+      unload_libs(&idle);
+
+      if (inst) {
+         *out = inst->passthrough ? inst->icds[0]->handle : (VkInstance)inst;
+      }
+      return res;
+   }
+
+   // Takes mutex_ itself.
+   void destroy_instance(Instance* const inst, const VkAllocationCallbacks* const alloc) {
+      {
+         std::unique_lock<std::mutex> lock(mutex_);
+         instances_.erase(std::find(instances_.begin(), instances_.end(), inst));
+         wait_for_slots(lock);
+      }
+      for (const auto& icd : inst->icds) {
+         destroy_icd_instance(icd.get(), alloc);
+      }
+      std::vector<std::unique_ptr<IcdLib>> idle;
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         for (const auto& icd : inst->icds) {
+            release_lib(icd->lib, &idle);
+         }
+      }
+      vk_delete(alloc, inst);
+      unload_libs(&idle);
+   }
+
+   // These two take mutex_ themselves, and call GetDeviceProcAddr without it, like
+   // create_instance.
+
+   void add_device(Device* const dev) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      uint32_t resolved = 0;
+      while (resolved < device_fn_names_.size()) {
+         const auto begin = resolved;
+         const std::vector<std::string> fn_names(device_fn_names_.begin() + begin,
+                                                 device_fn_names_.end());
+         lock.unlock();
+         for (uint32_t i = 0; i < fn_names.size(); i++) {
+            resolve_device_slot(dev, begin + i, fn_names[i]);
+         }
+         lock.lock();
+         resolved += fn_names.size();
+      }
+      devices_.push_back(dev);
+   }
+
+   void remove_device(Device* const dev) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      devices_.erase(std::find(devices_.begin(), devices_.end(), dev));
+      wait_for_slots(lock);
+   }
+
+   // For names we don't know at compile time: Hand out a tramp_pool trampoline,
+   // assigning it a slot if it's the first time we've seen the name.
+   // Instance-level commands share the phys-dev pool, since our Instance starts
+   // like a PhysDev does, but only work on single-ICD instances: Several ICDs
+   // would each need calling, and their surfaces and such merging.
+   // Takes mutex_ itself, and asks the ICDs without it.
+   PFN_vkVoidFunction unknown_fn(const Instance& inst, const char* const name) {
+      if (!tramp_pool_supported() || !api_subset_allows_fn(name))
+         return nullptr;
+      // These would hand out the ICD's own VkPhysicalDevices, which only
+      // passthrough instances can take.
+      if (starts_with(name, "vkEnumeratePhysicalDeviceGroups"))
+         return nullptr;
 
-#ifdef _WIN32
-#define WIN32_LEAN_AND_MEAN
-#include "Windows.h"
-#else
-#include <dlfcn.h>
-#endif
+      const bool is_instance_fn = is_instance_level_fn(name);
+      if (is_instance_fn && inst.icds.size() != 1)
+         return nullptr;
 
-// -
+      bool is_known_to_icd = false;
+      bool is_phys_dev_fn = false;
+      for (const auto& icd : inst.icds) {
+         const auto& lib = *icd->lib;
+         const bool is_known = bool(lib.pfnGetInstanceProcAddr(icd->handle, name));
+         if (is_known) {
+            is_known_to_icd = true;
+         }
+         if (lib.pfnGetPhysicalDeviceProcAddr) {
+            if (lib.pfnGetPhysicalDeviceProcAddr(icd->handle, name)) {
+               is_phys_dev_fn = true;
+            }
+         } else if (is_known && is_phys_dev_level_fn(name)) {
+            is_phys_dev_fn = true;
+         }
+      }
+      if (!is_known_to_icd && !is_phys_dev_fn)
+         return nullptr;
 
-class PlatformLib
-{
-public:
-   static std::unique_ptr<PlatformLib> Load(const std::string& path);
-   virtual PFN_vkVoidFunction GetProcAddress(const std::string& name) const = 0;
-};
+      if (is_phys_dev_fn || is_instance_fn) {
+         const auto slot = phys_dev_slot(name, is_instance_fn);
+         if (slot == UINT32_MAX)
+            return nullptr;
+         return phys_dev_tramp(slot, ApiTrace::enabled());
+      }
 
-#ifdef _WIN32
-class WindowsLib : public PlatformLib
-{
-   friend class PlatformLib;
-   const HMODULE lib_;
+      // Like the Khronos loader, assume anything else is device-level.
+      const auto slot = device_slot(name);
+      if (slot == UINT32_MAX)
+         return nullptr;
+      return device_tramp(slot, ApiTrace::enabled());
+   }
 
-public:
-   PFN_vkVoidFunction GetProcAddress(const std::string& name) const override {
-      return GetProcAddress(lib_, name.c_str());
+   // While tracing, vkGetDeviceProcAddr hands out trampolines too, so that device
+   // commands are traced. Untraced once the pool runs out.
+   // Takes mutex_ itself, and asks the ICD without it.
+   PFN_vkVoidFunction traced_device_fn(const Device& dev, const char* const name) {
+      const auto pfn = dev.GetDeviceProcAddr(dev.handle, name);
+      if (!pfn || !tramp_pool_supported())
+         return pfn;
+
+      const auto slot = device_slot(name);
+      if (slot == UINT32_MAX)
+         return pfn;
+      return device_tramp(slot, true);
    }
-};
 
-/*static*/
-std::unique_ptr<PlatformLib>
-PlatformLib::Load(const std::string& path)
-{
-   std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, wchar_t> utf8_to_utf16;
-   const auto wpath = utf8_to_utf16.from_bytes(path);
-   const auto lib = LoadLibraryW(wpath.c_str());
-   if (!lib)
-      return nullptr;
-   return as_unique(new WindowsLib{lib});
-}
-#else
-class UnixLib : public PlatformLib
-{
-   friend class PlatformLib;
-   void* const lib_;
+private:
+   // These two take mutex_ themselves. UINT32_MAX once the pool runs out.
 
-public:
-   PFN_vkVoidFunction GetProcAddress(const std::string& name) const override {
-      return dlsym(lib_, name.c_str());
+   uint32_t phys_dev_slot(const char* const name, const bool is_instance_fn) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      bool is_new;
+      const auto slot = find_or_add_slot(&phys_dev_fn_names_, name,
+                                         PHYS_DEV_TRAMP_COUNT, &is_new);
+      if (slot == UINT32_MAX)
+         return slot;
+      if (is_new) {
+         instance_fn_slots_.push_back(is_instance_fn);
+         ApiTrace::SetName(TRACE_PHYS_DEV_TRAMP_BASE + slot, name);
+      }
+      if (!claim_slot(lock, &phys_dev_slot_states_, slot))
+         return slot;
+
+      const auto insts = instances_;
+      const std::string fn_name = name;
+      const bool slot_is_instance_fn = instance_fn_slots_[slot];
+      lock.unlock();
+      for (const auto& inst : insts) {
+         for (const auto& icd : inst->icds) {
+            resolve_phys_dev_slot(icd.get(), slot, fn_name, slot_is_instance_fn);
+         }
+      }
+      lock.lock();
+      slot_resolved(&phys_dev_slot_states_, slot);
+      return slot;
    }
-};
 
-/*static*/
-std::unique_ptr<PlatformLib>
-PlatformLib::Load(const std::string& path)
-{
-   const auto lib = dlopen(path.c_str());
-   if (!lib)
-      return nullptr;
-   return as_unique(new UnixLib{lib});
-}
-#endif
+   uint32_t device_slot(const char* const name) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      bool is_new;
+      const auto slot = find_or_add_slot(&device_fn_names_, name, DEVICE_TRAMP_COUNT,
+                                         &is_new);
+      if (slot == UINT32_MAX)
+         return slot;
+      if (is_new) {
+         ApiTrace::SetName(TRACE_DEVICE_TRAMP_BASE + slot, name);
+      }
+      if (!claim_slot(lock, &device_slot_states_, slot))
+         return slot;
+
+      const auto devs = devices_;
+      const std::string fn_name = name;
+      lock.unlock();
+      for (const auto& dev : devs) {
+         resolve_device_slot(dev, slot, fn_name);
+      }
+      lock.lock();
+      slot_resolved(&device_slot_states_, slot);
+      return slot;
+   }
+};
 
 // -
+// VK_TINY_LOADER_TRACE: See api_trace.h. Like the Prefetcher, started as soon as
+// we're loaded.
 
-class IcdLib final
+class TraceLifetime final
 {
+   static TraceLifetime s_trace_lifetime;
+
+   TraceLifetime() { ApiTrace::Start(); }
+
 public:
-   const IcdInfo info_;
-   const std::unique_ptr<PlatformLib> lib_;
+   ~TraceLifetime() { ApiTrace::Finish(); }
+};
 
-   VKAPI_ATTR VkResult VKAPI_CALL (*pfnIcdNegotiate)(uint32_t* pSupportedVersion);
-   PFN_vkGetInstanceProcAddr pfnIcdGetInstanceProcAddr;
-   PFN_vkGetDeviceProcAddr pfnIcdGetDeviceProcAddr;
+/*static*/ TraceLifetime TraceLifetime::s_trace_lifetime;
 
-   const auto negotiate = (fnNegotiate*)lib->GetProcAddress("vk_icdNegotiateLoaderICDInterfaceVersion");
+// -
+// Opt-in: Start discovery (and optionally ICD loading) on a background thread as
+// soon as the loader library itself is loaded, so that it overlaps the app's own
+// init instead of stalling its first Vulkan call.
+//
+// VK_TINY_LOADER_PREFETCH=1: Enumerate and parse manifests.
+// VK_TINY_LOADER_PREFETCH=load: Also dlopen the ICDs.
+// Either way, we're never unloaded after that.
 
-   typedef VKAPI_ATTR VkResult VKAPI_CALL fnNegotiate(uint32_t* pSupportedVersion);
-   const auto get_inst_sym = (PFN_vkGetInstanceProcAddr)lib->GetProcAddress("vk_icdNegotiateLoaderICDInterfaceVersion");
+class Prefetcher final
+{
+   // Shared with the thread, which can outlive us. (see ~Prefetcher)
+   struct State final
+   {
+      std::atomic<bool> should_stop{false};
+      std::atomic<bool> done{false};
+   };
 
+   std::unique_ptr<std::thread> thread_;
+   const std::shared_ptr<State> state_ = std::make_shared<State>();
 
-   static std::unique_ptr<IcdLib> Load(const IcdInfo& info) {
-      // TODO: Need to allow loading from a relpath from the json dir.
-      auto lib = PlatformLib::Load(info.library_path);
-      if (!lib)
-         return nullptr;
+   static Prefetcher s_prefetcher;
 
-      const auto icd_iface_version = [&]() {
-         if (!negotiate)
-            return 0;
-      }();
+   Prefetcher() {
+      const auto env = getenv("VK_TINY_LOADER_PREFETCH");
+      if (!env || !*env || std::string(env) == "0")
+         return;
+      const bool should_load = (std::string(env) == "load");
 
-      return as_unique(new IcdLib{ info, std::move(lib) });
+      auto& loader = Loader::Get();
+#ifndef _WIN32
+      // The thread doesn't exist in a forked child. The child just sees however
+      // far the prefetch got, and does the rest synchronously. (see Loader())
+      (void)pthread_atfork(nullptr, nullptr, []() {
+         (void)s_prefetcher.thread_.release();
+      });
+#endif
+      // Up front, since pinning from ~Prefetcher would be too late: Once being
+      // unloaded, dlopen'ing ourselves again would rerun our constructors.
+      pin_self();
+      const auto state = state_;
+      thread_.reset(new std::thread([&loader, should_load, state]() {
+         loader.prefetch(should_load, state->should_stop);
+         state->done = true;
+      }));
    }
 
-private:
-   IcdLib(std::unique_ptr<PlatformLib> lib)
-      : lib_(std::move(lib))
-   {
-      pfnIcdNegotiate =
+public:
+   ~Prefetcher() {
+      // Early exit: Stop at the next step. The Loader is never destroyed, and
+      // we're pinned, so rather than wait out a step that's still going (e.g. a
+      // slow dlopen), leave the thread to finish it.
+      state_->should_stop = true;
+      if (!thread_ || !thread_->joinable())
+         return;
+      if (state_->done) {
+         thread_->join();
+         return;
+      }
+      thread_->detach();
    }
 };
 
-class Loader final
+/*static*/ Prefetcher Prefetcher::s_prefetcher;
+
+// -
+
+void
+vktl::set_icd_filter(const IcdFilter& filter)
 {
-   std::unordered_map<std::string, std::unique_ptr<IcdLib>> libs_by_path_;
+   Loader::Get().set_app_filter(filter);
+}
 
-   // Enumerables:
-   std::unordered_map<std::string, std::vector<VkExtensionProperties>> ext_props_by_layer_;
-   std::vector<VkLayerProperties> layer_props_;
+PlatformLib::pfn_t
+vktl::IcdProcAddrLib::get_proc_address(const std::string& name) const
+{
+   if (name == "vk_icdGetInstanceProcAddr")
+      return (pfn_t)icd_gipa_;
+   return (pfn_t)icd_gipa_(nullptr, name.c_str());
+}
 
-   static std::unique_ptr<Loader> s_loader;
-public:
-   static Loader& Get() {
-      if (!s_loader) {
-         s_loader.reset(new Loader);
-      }
-      return *s_loader;
-   }
+vktl::Snapshot::Snapshot(std::shared_ptr<const SnapshotGlobals> globals,
+                         std::shared_ptr<const std::vector<VkPhysicalDevice>> phys_devs)
+   : globals_(std::move(globals))
+   , phys_devs_(std::move(phys_devs))
+{ }
 
-private:
-   Loader() {
-   }
+Range<const IcdInfo*>
+vktl::Snapshot::icd_infos() const
+{
+   return range(globals_->icd_infos.data(), globals_->icd_infos.size());
+}
 
-public:
-   const auto& libs() {
-      const auto icds = EnumIcds();
-      for (const auto& new_icd : icds) {
-         bool is_new = true;
-         const auto res = libs_by_path_.insert({ new_icd.library_path, nullptr });
-         const bool& did_insert = res.second;
-         if (!did_insert)
-            continue;
-         const auto& itr = res.first;
+Range<const FoldedIcd*>
+vktl::Snapshot::folded_icds() const
+{
+   return range(globals_->folded_icds.data(), globals_->folded_icds.size());
+}
 
-         itr->second = IcdLib::Load(icd);
-         if (!itr->second) {
-            libs_by_path_.erase(itr);
-         }
-      }
-      return libs_by_path_;
-   }
+Range<const VkExtensionProperties*>
+vktl::Snapshot::instance_exts() const
+{
+   return range(globals_->instance_exts.data(), globals_->instance_exts.size());
+}
 
-   const auto& ext_props_by_layer(const std::string& layer_name) {
-      auto& ret = ext_props_by_layer_[layer_name];
-      ret.clear();
+Range<const VkLayerProperties*>
+vktl::Snapshot::layers() const
+{
+   return range(globals_->layers.data(), globals_->layers.size());
+}
 
-      const auto& libs = libs();
-      for (const auto& kv : libs) {
-         const auto& lib = kv.second;
-         std::vector<VkExtensionProperties> cur;
-         while (true) {
-            uint32_t count = 0;
-            (void)lib->vkEnumerateInstanceExtensionProperties(layer_name.c_str(), &count, nullptr);
-            cur.reserve(count);
-            const auto res = lib->vkEnumerateInstanceExtensionProperties(layer_name.c_str(), &count, cur.data());
-            if (res != VK_INCOMPLETE)
-               break;
-         }
-         ret.insert(ret.end(), cur.begin(), cur.end());
-      }
-      return ret;
+uint32_t
+vktl::Snapshot::instance_version() const
+{
+   return globals_->instance_version;
+}
+
+Range<const VkPhysicalDevice*>
+vktl::Snapshot::phys_devs() const
+{
+   if (!phys_devs_)
+      return {};
+   return range(phys_devs_->data(), phys_devs_->size());
+}
+
+vktl::Snapshot
+vktl::snapshot(const VkInstance instance)
+{
+   auto globals = Loader::Get().snapshot_globals();
+
+   std::shared_ptr<const std::vector<VkPhysicalDevice>> phys_devs;
+   if (instance) {
+      auto& inst = *instance_from(instance);
+      const std::lock_guard<std::mutex> lock(inst.phys_devs_mutex);
+      inst.enumerate_phys_devs();
+      phys_devs = inst.phys_devs_snapshot();
    }
+   return Snapshot(std::move(globals), std::move(phys_devs));
+}
 
-   const auto& layer_props() {
-      return layer_props_;
+bool
+vktl::DeviceCriteria::accepts(const VkPhysicalDeviceProperties& props) const
+{
+   if (device_types.size() &&
+       std::find(device_types.begin(), device_types.end(), props.deviceType) ==
+          device_types.end())
+   {
+      return false;
    }
-};
+   if (vendor_id && props.vendorID != vendor_id)
+      return false;
+   return props.apiVersion >= min_api_version;
+}
 
-extern "C" {
+void
+vktl::set_device_criteria(const DeviceCriteria* const criteria)
+{
+   auto& loader = Loader::Get();
+   const std::lock_guard<std::mutex> lock(loader.mutex_);
+   loader.set_device_criteria(criteria);
+}
 
-VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
-vkGetInstanceProcAddr(const VkInstance instance, const char* const name)
+void
+vktl::add_direct_driver(std::unique_ptr<PlatformLib> lib, const std::string& name)
+{
+   if (!Loader::Get().add_direct_icd(std::move(lib), name)) {
+      debug_log("Direct driver %s rejected.", name.c_str());
+   }
+}
+
+void
+vktl::set_direct_drivers_exclusive(const bool exclusive)
 {
+   Loader::Get().set_direct_icds_exclusive(exclusive);
+}
 
+uint64_t
+vktl::reclaimed_icd_bytes()
+{
+   return Loader::Get().reclaimed_bytes();
 }
 
+// -
+
 template<typename T>
 static VkResult
 vk_copy_meme(const std::vector<T>& src, uint32_t* const count, T* const dest)
@@ -197,120 +1895,508 @@ vk_copy_meme(const std::vector<T>& src, uint32_t* const count, T* const dest)
    return ret;
 }
 
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceLayerProperties(
+// -
+
+extern "C" {
+
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceLayerProperties(
     uint32_t*                                   pPropertyCount,
     VkLayerProperties*                          pProperties)
 {
-   // The list of available layers may change at any time due to actions outside
-   // of the Vulkan implementation, so two calls to
-   // vkEnumerateInstanceLayerProperties with the same parameters may return
-   // different results, or retrieve different pPropertyCount values or
-   // pProperties contents.
-   auto& loader = Loader::Get();
-   const auto& props = loader.layer_props();
-   return vk_copy_meme(props, pPropertyCount, pProperties);
+   return traced(TRACE_EnumerateInstanceLayerProperties, nullptr, [=]() {
+      // The list of available layers may change at any time due to actions
+      // outside of the Vulkan implementation, so two calls to
+      // vkEnumerateInstanceLayerProperties with the same parameters may return
+      // different results, or retrieve different pPropertyCount values or
+      // pProperties contents.
+      auto& loader = Loader::Get();
+      const std::lock_guard<std::mutex> lock(loader.mutex_);
+      const auto& props = loader.layer_props();
+      return vk_copy_meme(props, pPropertyCount, pProperties);
+   });
 }
 
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceExtensionProperties(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceExtensionProperties(
     const char*                                 pLayerName,
     uint32_t*                                   pPropertyCount,
     VkExtensionProperties*                      pProperties)
 {
-   auto& loader = Loader::Get();
-   const auto& props = loader.ext_props_by_layer(pLayerName);
-   return vk_copy_meme(props, pPropertyCount, pProperties);
+   return traced(TRACE_EnumerateInstanceExtensionProperties, nullptr, [=]() {
+      auto& loader = Loader::Get();
+      const auto props = loader.instance_exts(pLayerName ? pLayerName : "");
+      return vk_copy_meme(props, pPropertyCount, pProperties);
+   });
+}
+
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceVersion(
+    uint32_t*                                   pApiVersion)
+{
+   return traced(TRACE_EnumerateInstanceVersion, nullptr, [=]() {
+      auto& loader = Loader::Get();
+      *pApiVersion = loader.instance_version();
+      return VK_SUCCESS;
+   });
 }
 
 
-VKAPI_ATTR VkResult VKAPI_CALL
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL
 vkCreateInstance(const VkInstanceCreateInfo* const info,
                  const VkAllocationCallbacks* const alloc,
                  VkInstance* const out)
 {
-}
+   return traced(TRACE_CreateInstance, nullptr, [=]() {
+      if (info->enabledLayerCount)
+         return VK_ERROR_LAYER_NOT_PRESENT; // No layer support yet.
 
+      auto& loader = Loader::Get();
+      return loader.create_instance(*info, alloc, out);
+   });
+}
 
-
-
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateDeviceExtensionProperties(
-    VkPhysicalDevice                            physicalDevice,
-    const char*                                 pLayerName,
-    uint32_t*                                   pPropertyCount,
-    VkExtensionProperties*                      pProperties);
-
-VKAPI_ATTR void VKAPI_CALL vkDestroyInstance(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR void VKAPI_CALL vkDestroyInstance(
     VkInstance                                  instance,
-    const VkAllocationCallbacks*                pAllocator);
+    const VkAllocationCallbacks*                pAllocator)
+{
+   return traced(TRACE_DestroyInstance, instance, [=]() {
+      if (!instance)
+         return;
 
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumeratePhysicalDevices(
+      auto& loader = Loader::Get();
+      loader.destroy_instance(instance_from(instance), pAllocator);
+   });
+}
+
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkEnumeratePhysicalDevices(
     VkInstance                                  instance,
     uint32_t*                                   pPhysicalDeviceCount,
-    VkPhysicalDevice*                           pPhysicalDevices);
+    VkPhysicalDevice*                           pPhysicalDevices)
+{
+   return traced(TRACE_EnumeratePhysicalDevices, instance, [=]() {
+      auto& inst = *instance_from(instance);
+      const std::lock_guard<std::mutex> lock(inst.phys_devs_mutex);
+      inst.enumerate_phys_devs();
+      return vk_copy_meme(inst.phys_devs, pPhysicalDeviceCount, pPhysicalDevices);
+   });
+}
 
-VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceFeatures(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceFeatures(
     VkPhysicalDevice                            physicalDevice,
-    VkPhysicalDeviceFeatures*                   pFeatures);
+    VkPhysicalDeviceFeatures*                   pFeatures)
+{
+   return traced(TRACE_GetPhysicalDeviceFeatures, physicalDevice, [=]() {
+      const auto& pd = *phys_dev_from(physicalDevice);
+      pd.dispatch->GetPhysicalDeviceFeatures(pd.handle, pFeatures);
+   });
+}
 
-VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceFormatProperties(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceFormatProperties(
     VkPhysicalDevice                            physicalDevice,
     VkFormat                                    format,
-    VkFormatProperties*                         pFormatProperties);
+    VkFormatProperties*                         pFormatProperties)
+{
+   return traced(TRACE_GetPhysicalDeviceFormatProperties, physicalDevice, [=]() {
+      const auto& pd = *phys_dev_from(physicalDevice);
+      const auto& fn = pd.dispatch->GetPhysicalDeviceFormatProperties;
+      if (pd.query_cache && uint32_t(format) < VK_FORMAT_RANGE_SIZE) {
+         auto& entry = pd.query_cache->formats[format];
+         auto cached = entry.get();
+         if (!cached) {
+            cached = entry.fill([&](VkFormatProperties* const out) {
+               fn(pd.handle, format, out);
+            });
+         }
+         if (cached) {
+            *pFormatProperties = *cached;
+            return;
+         }
+      }
+      fn(pd.handle, format, pFormatProperties);
+   });
+}
 
-VKAPI_ATTR VkResult VKAPI_CALL vkGetPhysicalDeviceImageFormatProperties(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkGetPhysicalDeviceImageFormatProperties(
     VkPhysicalDevice                            physicalDevice,
     VkFormat                                    format,
     VkImageType                                 type,
     VkImageTiling                               tiling,
     VkImageUsageFlags                           usage,
     VkImageCreateFlags                          flags,
-    VkImageFormatProperties*                    pImageFormatProperties);
+    VkImageFormatProperties*                    pImageFormatProperties)
+{
+   return traced(TRACE_GetPhysicalDeviceImageFormatProperties, physicalDevice, [=]() {
+      const auto& pd = *phys_dev_from(physicalDevice);
+      return pd.dispatch->GetPhysicalDeviceImageFormatProperties(
+         pd.handle, format, type, tiling, usage, flags, pImageFormatProperties);
+   });
+}
 
-VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceProperties(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceProperties(
     VkPhysicalDevice                            physicalDevice,
-    VkPhysicalDeviceProperties*                 pProperties);
+    VkPhysicalDeviceProperties*                 pProperties)
+{
+   return traced(TRACE_GetPhysicalDeviceProperties, physicalDevice, [=]() {
+      const auto& pd = *phys_dev_from(physicalDevice);
+      const auto& fn = pd.dispatch->GetPhysicalDeviceProperties;
+      if (pd.query_cache) {
+         auto& entry = pd.query_cache->props;
+         auto cached = entry.get();
+         if (!cached) {
+            cached = entry.fill([&](VkPhysicalDeviceProperties* const out) {
+               fn(pd.handle, out);
+            });
+         }
+         if (cached) {
+            *pProperties = *cached;
+            return;
+         }
+      }
+      fn(pd.handle, pProperties);
+   });
+}
 
-VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceQueueFamilyProperties(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceQueueFamilyProperties(
     VkPhysicalDevice                            physicalDevice,
     uint32_t*                                   pQueueFamilyPropertyCount,
-    VkQueueFamilyProperties*                    pQueueFamilyProperties);
+    VkQueueFamilyProperties*                    pQueueFamilyProperties)
+{
+   return traced(TRACE_GetPhysicalDeviceQueueFamilyProperties, physicalDevice, [=]() {
+      const auto& pd = *phys_dev_from(physicalDevice);
+      const auto& fn = pd.dispatch->GetPhysicalDeviceQueueFamilyProperties;
+      if (pd.query_cache) {
+         auto& entry = pd.query_cache->queue_families;
+         auto cached = entry.get();
+         if (!cached) {
+            cached = entry.fill([&](std::vector<VkQueueFamilyProperties>* const out) {
+               uint32_t count = 0;
+               fn(pd.handle, &count, nullptr);
+               out->resize(count);
+               fn(pd.handle, &count, out->data());
+               out->resize(count);
+            });
+         }
+         if (cached) {
+            if (!pQueueFamilyProperties) {
+               *pQueueFamilyPropertyCount = uint32_t(cached->size());
+               return;
+            }
+            const auto count = std::min(*pQueueFamilyPropertyCount,
+                                        uint32_t(cached->size()));
+            std::copy(cached->begin(), cached->begin() + count, pQueueFamilyProperties);
+            *pQueueFamilyPropertyCount = count;
+            return;
+         }
+      }
+      fn(pd.handle, pQueueFamilyPropertyCount, pQueueFamilyProperties);
+   });
+}
+
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceMemoryProperties(
+    VkPhysicalDevice                            physicalDevice,
+    VkPhysicalDeviceMemoryProperties*           pMemoryProperties)
+{
+   return traced(TRACE_GetPhysicalDeviceMemoryProperties, physicalDevice, [=]() {
+      const auto& pd = *phys_dev_from(physicalDevice);
+      const auto& fn = pd.dispatch->GetPhysicalDeviceMemoryProperties;
+      if (pd.query_cache) {
+         auto& entry = pd.query_cache->mem_props;
+         auto cached = entry.get();
+         if (!cached) {
+            cached = entry.fill([&](VkPhysicalDeviceMemoryProperties* const out) {
+               fn(pd.handle, out);
+            });
+         }
+         if (cached) {
+            *pMemoryProperties = *cached;
+            return;
+         }
+      }
+      fn(pd.handle, pMemoryProperties);
+   });
+}
 
-VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceMemoryProperties(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateDeviceExtensionProperties(
     VkPhysicalDevice                            physicalDevice,
-    VkPhysicalDeviceMemoryProperties*           pMemoryProperties);
+    const char*                                 pLayerName,
+    uint32_t*                                   pPropertyCount,
+    VkExtensionProperties*                      pProperties)
+{
+   return traced(TRACE_EnumerateDeviceExtensionProperties, physicalDevice, [=]() {
+      if (pLayerName && *pLayerName)
+         return VK_ERROR_LAYER_NOT_PRESENT;
 
-VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL vkGetDeviceProcAddr(
-    VkDevice                                    device,
-    const char*                                 pName);
+      const auto& pd = *phys_dev_from(physicalDevice);
+      const auto& fn = pd.dispatch->EnumerateDeviceExtensionProperties;
+      if (!HAS_API_SUBSET)
+         return fn(pd.handle, nullptr, pPropertyCount, pProperties);
+
+      std::vector<VkExtensionProperties> props;
+      while (true) {
+         uint32_t count = 0;
+         auto res = fn(pd.handle, nullptr, &count, nullptr);
+         if (res != VK_SUCCESS)
+            return res;
+         props.resize(count);
+         res = fn(pd.handle, nullptr, &count, props.data());
+         if (res == VK_INCOMPLETE)
+            continue;
+         if (res != VK_SUCCESS)
+            return res;
+         props.resize(count);
+         break;
+      }
+      props.erase(std::remove_if(props.begin(), props.end(), [](const auto& x) {
+         return !api_subset_allows_ext(x.extensionName);
+      }), props.end());
+      return vk_copy_meme(props, pPropertyCount, pProperties);
+   });
+}
+
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateDeviceLayerProperties(
+    VkPhysicalDevice                            physicalDevice,
+    uint32_t*                                   pPropertyCount,
+    VkLayerProperties*                          pProperties)
+{
+   return traced(TRACE_EnumerateDeviceLayerProperties, physicalDevice, [=]() {
+      (void)pProperties;
+      *pPropertyCount = 0;
+      return VK_SUCCESS;
+   });
+}
 
-VKAPI_ATTR VkResult VKAPI_CALL vkCreateDevice(
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR VkResult VKAPI_CALL vkCreateDevice(
     VkPhysicalDevice                            physicalDevice,
     const VkDeviceCreateInfo*                   pCreateInfo,
     const VkAllocationCallbacks*                pAllocator,
-    VkDevice*                                   pDevice);
+    VkDevice*                                   pDevice)
+{
+   return traced(TRACE_CreateDevice, physicalDevice, [=]() {
+      const auto& pd = *phys_dev_from(physicalDevice);
+      const auto& icd = *pd.icd;
+      for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++) {
+         if (!api_subset_allows_ext(pCreateInfo->ppEnabledExtensionNames[i]))
+            return VK_ERROR_EXTENSION_NOT_PRESENT;
+      }
+
+      const auto dev = vk_new<Device>(pAllocator, VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+      if (!dev)
+         return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+      const auto res = icd.dispatch.CreateDevice(pd.handle, pCreateInfo, pAllocator,
+                                                 &dev->handle);
+      if (res != VK_SUCCESS) {
+         vk_delete(pAllocator, dev);
+         return res;
+      }
+      dev->GetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)
+         icd.lib->pfnGetInstanceProcAddr(icd.handle, "vkGetDeviceProcAddr");
+      dev->DestroyDevice = (PFN_vkDestroyDevice)
+         dev->GetDeviceProcAddr(dev->handle, "vkDestroyDevice");
+#define _(x) dev->x = (PFN_vk##x)dev->GetDeviceProcAddr(dev->handle, "vk" #x);
+      FOR_EACH_WRAPPED_DEVICE_FN(_)
+#undef _
+
+      // The ICD reserves the first word of its dispatchable objects for us.
+      *(Device**)dev->handle = dev;
 
-VKAPI_ATTR void VKAPI_CALL vkDestroyDevice(
+      Loader::Get().add_device(dev);
+      *pDevice = dev->handle;
+      return VK_SUCCESS;
+   });
+}
+
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR void VKAPI_CALL vkDestroyDevice(
     VkDevice                                    device,
-    const VkAllocationCallbacks*                pAllocator);
+    const VkAllocationCallbacks*                pAllocator)
+{
+   return traced(TRACE_DestroyDevice, device, [=]() {
+      if (!device)
+         return;
+      const auto dev = device_from(device);
 
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceExtensionProperties(
-    const char*                                 pLayerName,
-    uint32_t*                                   pPropertyCount,
-    VkExtensionProperties*                      pProperties);
+      Loader::Get().remove_device(dev);
+      dev->DestroyDevice(device, pAllocator);
+      vk_delete(pAllocator, dev);
+   });
+}
 
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateDeviceExtensionProperties(
-    VkPhysicalDevice                            physicalDevice,
-    const char*                                 pLayerName,
-    uint32_t*                                   pPropertyCount,
-    VkExtensionProperties*                      pProperties);
+// -
+// Device trampolines (from vkGetInstanceProcAddr on wrapped instances, or from
+// vkGetDeviceProcAddr while tracing) find their slots via the first arg's
+// loader-data word. Queues and command buffers are the ICD's own, so always point
+// theirs at the Device, as vkCreateDevice does for the device, and as the Khronos
+// loader does. Otherwise vkQueueSubmit and vkCmd* trampolines would read the ICD's
+// ICD_LOADER_MAGIC as a Device*.
 
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateInstanceLayerProperties(
-    uint32_t*                                   pPropertyCount,
-    VkLayerProperties*                          pProperties);
+static VKAPI_ATTR void VKAPI_CALL
+wrapped_get_device_queue(const VkDevice device, const uint32_t family,
+                        const uint32_t index, VkQueue* const out)
+{
+   const TraceCall trace(TRACE_GetDeviceQueue, device);
+   const auto dev = device_from(device);
+   dev->GetDeviceQueue(device, family, index, out);
+   if (*out) {
+      *(Device**)*out = dev;
+   }
+}
 
-VKAPI_ATTR VkResult VKAPI_CALL vkEnumerateDeviceLayerProperties(
-    VkPhysicalDevice                            physicalDevice,
-    uint32_t*                                   pPropertyCount,
-    VkLayerProperties*                          pProperties);
+static VKAPI_ATTR void VKAPI_CALL
+wrapped_get_device_queue2(const VkDevice device, const VkDeviceQueueInfo2* const info,
+                         VkQueue* const out)
+{
+   const TraceCall trace(TRACE_GetDeviceQueue2, device);
+   const auto dev = device_from(device);
+   dev->GetDeviceQueue2(device, info, out);
+   if (*out) {
+      *(Device**)*out = dev;
+   }
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+wrapped_allocate_command_buffers(const VkDevice device,
+                                const VkCommandBufferAllocateInfo* const info,
+                                VkCommandBuffer* const out)
+{
+   TraceCall trace(TRACE_AllocateCommandBuffers, device);
+   const auto dev = device_from(device);
+   const auto res = dev->AllocateCommandBuffers(device, info, out);
+   if (res == VK_SUCCESS) {
+      for (uint32_t i = 0; i < info->commandBufferCount; i++) {
+         *(Device**)out[i] = dev;
+      }
+   }
+   return trace.ret(res);
+}
+
+// Null if not wrapped.
+static PFN_vkVoidFunction
+wrapped_fn(const char* const name)
+{
+   if (strcmp(name, "vkGetDeviceQueue") == 0)
+      return (PFN_vkVoidFunction)&wrapped_get_device_queue;
+   if (strcmp(name, "vkGetDeviceQueue2") == 0)
+      return (PFN_vkVoidFunction)&wrapped_get_device_queue2;
+   if (strcmp(name, "vkAllocateCommandBuffers") == 0)
+      return (PFN_vkVoidFunction)&wrapped_allocate_command_buffers;
+   return nullptr;
+}
+
+VKTL_EXPORT_UNLESS_SUBSET VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL vkGetDeviceProcAddr(
+    VkDevice                                    device,
+    const char*                                 pName)
+{
+   return traced(TRACE_GetDeviceProcAddr, device, [=]() -> PFN_vkVoidFunction {
+      // We need to see these two, and the wrapped ones. Everything else goes
+      // straight to the ICD.
+      if (strcmp(pName, "vkGetDeviceProcAddr") == 0)
+         return (PFN_vkVoidFunction)&vkGetDeviceProcAddr;
+      if (strcmp(pName, "vkDestroyDevice") == 0)
+         return (PFN_vkVoidFunction)&vkDestroyDevice;
+
+      const auto& dev = *device_from(device);
+      const auto wrapper = wrapped_fn(pName);
+      if (wrapper)
+         return dev.GetDeviceProcAddr(device, pName) ? wrapper : nullptr;
+      if (!ApiTrace::enabled())
+         return dev.GetDeviceProcAddr(device, pName);
 
+      // Unless we're tracing.
+      return Loader::Get().traced_device_fn(dev, pName);
+   });
+}
+
+// -
+
+struct NamedFn final
+{
+   const char* name;
+   PFN_vkVoidFunction pfn;
+};
+
+// Null, if the API subset leaves it out, so that neither its name nor its code
+// need be in the binary. (see api_subset.h)
+#define _(x) { VKTL_SUBSET_FN_NAME("vk" #x), \
+               (PFN_vkVoidFunction)(VKTL_SUBSET_ALLOWS_FN("vk" #x) ? &vk##x : nullptr) },
+
+static const NamedFn GLOBAL_FNS[] = {
+   _(CreateInstance)
+   _(EnumerateInstanceExtensionProperties)
+   _(EnumerateInstanceLayerProperties)
+   _(EnumerateInstanceVersion)
+};
+
+static const NamedFn INSTANCE_FNS[] = {
+   FOR_EACH_INSTANCE_FN(_)
+   _(EnumerateDeviceLayerProperties)
+   _(GetDeviceProcAddr)
+   _(DestroyDevice)
+};
+
+// Still ours for passthrough instances: Lifetimes, and handle bookkeeping.
+static const NamedFn PASSTHROUGH_KEPT_FNS[] = {
+   _(DestroyInstance)
+   _(EnumeratePhysicalDevices)
+   _(CreateDevice)
+   _(EnumerateDeviceExtensionProperties) // For refusing layer names.
+   _(EnumerateDeviceLayerProperties)
+   _(GetDeviceProcAddr)
+   _(DestroyDevice)
+};
+
+#undef _
+
+static PFN_vkVoidFunction
+find_fn(const NamedFn* const begin, const NamedFn* const end, const char* const name)
+{
+   for (const auto& x : range(begin, end)) {
+      if (x.name && strcmp(x.name, name) == 0)
+         return x.pfn;
+   }
+   return nullptr;
+}
+
+VKTL_EXPORT VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
+vkGetInstanceProcAddr(const VkInstance instance, const char* const name)
+{
+   return traced(TRACE_GetInstanceProcAddr, instance, [=]() -> PFN_vkVoidFunction {
+      if (strcmp(name, "vkGetInstanceProcAddr") == 0)
+         return (PFN_vkVoidFunction)&vkGetInstanceProcAddr;
+
+      auto ret = find_fn(std::begin(GLOBAL_FNS), std::end(GLOBAL_FNS), name);
+      if (ret)
+         return ret;
+      if (!instance)
+         return nullptr;
+      const auto& inst = *instance_from(instance);
+
+      if (inst.passthrough) {
+         ret = find_fn(std::begin(PASSTHROUGH_KEPT_FNS), std::end(PASSTHROUGH_KEPT_FNS),
+                       name);
+         if (!ret && phys_dev_query_cache_enabled()) {
+            ret = find_fn(std::begin(INSTANCE_FNS), std::end(INSTANCE_FNS), name);
+         }
+         if (ret)
+            return ret;
+         if (!api_subset_allows_fn(name) &&
+             !find_fn(std::begin(INSTANCE_FNS), std::end(INSTANCE_FNS), name))
+         {
+            return nullptr;
+         }
+         const auto& icd = *inst.icds[0];
+         return icd.lib->pfnGetInstanceProcAddr(icd.handle, name);
+      }
+
+      ret = find_fn(std::begin(INSTANCE_FNS), std::end(INSTANCE_FNS), name);
+      if (ret)
+         return ret;
+
+      ret = Loader::Get().unknown_fn(inst, name);
+      if (ret) {
+         const auto wrapper = wrapped_fn(name);
+         if (wrapper)
+            return wrapper;
+      }
+      return ret;
+   });
+}
 
 } // extern "C"
@@ -0,0 +1,114 @@
+#ifndef VK_TINY_LOADER_H
+#define VK_TINY_LOADER_H
+
+// C++ extras for apps that link against vk_tiny_loader directly.
+
+#include "loader_exports.h" // Before vulkan.h.
+
+#include "dyn_lib.h"
+#include "find_icds.h"
+#include "range.h"
+#include "vulkan/vulkan.h"
+
+namespace vktl {
+
+// Applied on top of IcdFilter::from_env(); a driver has to pass both.
+// Takes effect for drivers not yet loaded.
+void set_icd_filter(const IcdFilter& filter);
+
+// Total mapped image bytes released by unloading ICDs that had no devices or
+// were no longer referenced by any instance. (0 where unmeasurable)
+uint64_t reclaimed_icd_bytes();
+
+// -
+// Zero-copy enumeration: Range views straight into the loader's own arrays, which
+// are immutable and kept alive by the Snapshot (and its copies). Once nothing
+// changes, taking a snapshot neither copies nor allocates.
+// Global state is gathered on first use, and only re-gathered after the vktl::
+// settings change, so newly installed drivers show up via the C entrypoints
+// before they show up here.
+
+struct SnapshotGlobals;
+
+class Snapshot final
+{
+   std::shared_ptr<const SnapshotGlobals> globals_;
+   std::shared_ptr<const std::vector<VkPhysicalDevice>> phys_devs_;
+
+public:
+   Snapshot(std::shared_ptr<const SnapshotGlobals> globals,
+            std::shared_ptr<const std::vector<VkPhysicalDevice>> phys_devs);
+
+   Range<const IcdInfo*> icd_infos() const;
+   // Left out of icd_infos(), as duplicates of one already in it. (The same
+   // files via symlinks and such)
+   Range<const FoldedIcd*> folded_icds() const;
+   Range<const VkExtensionProperties*> instance_exts() const;
+   Range<const VkLayerProperties*> layers() const;
+   uint32_t instance_version() const;
+
+   // Empty unless taken with an instance.
+   Range<const VkPhysicalDevice*> phys_devs() const;
+};
+
+// With an instance, this enumerates its physical devices, like
+// vkEnumeratePhysicalDevices.
+Snapshot snapshot(VkInstance instance = VK_NULL_HANDLE);
+
+// -
+// Early-exit device selection: With criteria set, vkCreateInstance probes ICDs in
+// order and keeps only the first one with a matching physical device. Later ICDs
+// aren't even loaded, and ICDs whose manifest api_version is too low are skipped
+// unopened. The kept ICD's other devices are still enumerated.
+// Fails with VK_ERROR_INCOMPATIBLE_DRIVER if nothing matches.
+
+struct DeviceCriteria final
+{
+   // Empty/zero matches anything.
+   std::vector<VkPhysicalDeviceType> device_types; // Any of these.
+   uint32_t vendor_id = 0;
+   std::vector<std::string> device_exts; // All of these.
+   uint32_t min_api_version = 0;
+
+   bool accepts(const VkPhysicalDeviceProperties& props) const;
+};
+
+// Null to go back to keeping every ICD with devices.
+void set_device_criteria(const DeviceCriteria* criteria);
+
+// -
+// Direct driver loading, in the spirit of VK_LUNARG_direct_driver_loading: For
+// drivers bundled with (or linked into) the app, skip manifests and dlopen.
+// Direct drivers come before discovered ones, aren't subject to IcdFilters, and
+// are never unloaded.
+
+// Wraps a driver's vk_icdGetInstanceProcAddr. The other vk_icd* entrypoints are
+// queried through it with a null instance.
+class IcdProcAddrLib final : public PlatformLib
+{
+   const PFN_vkGetInstanceProcAddr icd_gipa_;
+
+public:
+   explicit IcdProcAddrLib(PFN_vkGetInstanceProcAddr icd_gipa)
+      : icd_gipa_(icd_gipa)
+   { }
+
+   pfn_t get_proc_address(const std::string& name) const override;
+};
+
+// `name` just identifies the driver in logs. It must be unique.
+void add_direct_driver(std::unique_ptr<PlatformLib> lib, const std::string& name);
+
+inline void
+add_direct_driver(const PFN_vkGetInstanceProcAddr icd_gipa, const std::string& name)
+{
+   add_direct_driver(std::unique_ptr<PlatformLib>(new IcdProcAddrLib(icd_gipa)), name);
+}
+
+// If exclusive, only direct drivers are used: No enum_icd_paths(), no manifests,
+// no dlopen.
+void set_direct_drivers_exclusive(bool exclusive);
+
+} // namespace vktl
+
+#endif // VK_TINY_LOADER_H